@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/ATCommand.h
+ *
+ * Type-checked AT command line builder
+ */
+
+#pragma once
+
+#include <base/base.h>
+
+#include <limits>
+#include <type_traits>
+
+//! Length of the host name stored in a pooled socket, sockets with longer host names are allocated from the heap;
+//! AT commands are sized to carry a host name of this length
+#ifndef GSM_POOL_HOST_LENGTH
+#define GSM_POOL_HOST_LENGTH    64
+#endif
+
+namespace gsm
+{
+
+//! Wraps a string argument of an AT command that must be enclosed in double quotes
+struct ATQuoted
+{
+    Span value;
+};
+
+inline ATQuoted ATQuote(Span value) { return { value }; }
+
+//! Fixed-size buffer holding a complete AT command line
+//!
+//! The command is rendered once from a list of fragments - characters,
+//! strings, Spans, ATQuoted strings and integers - and the same buffer is
+//! then used both for the diagnostic callback and for the transmission.
+//! Argument types are resolved at compile time, unsupported types fail
+//! to compile instead of being misinterpreted like printf arguments.
+class ATCommand
+{
+public:
+    enum
+    {
+        //! Longest command without the host name, e.g. AT+CIPSTART="TCP","<host>","65535"
+        //! or AT+CIPSEND=9,1500,"<address>",65535
+        MaxOverhead = 48,
+        MaxLength = GSM_POOL_HOST_LENGTH + MaxOverhead,
+    };
+
+    //! Renders the command from the specified fragments, the AT prefix is added automatically
+    //! @returns false if the command does not fit in the buffer
+    template<typename... Args> bool Format(const Args&... args)
+    {
+        len = 2;
+        overflow = false;
+        int expand[] = { 0, (Append(args), 0)... };
+        (void)expand;
+        return !overflow;
+    }
+
+    bool Overflow() const { return overflow; }
+
+    //! Command text including the AT prefix, without the terminating CR
+    Span Command() const { return Span(buf, len); }
+    //! Command text without the AT prefix
+    Span Body() const { return Span(buf + 2, len - 2); }
+    //! Complete command line including the terminating CR
+    Span Line() { buf[len] = '\r'; return Span(buf, len + 1); }
+
+private:
+    char buf[MaxLength + 1] = { 'A', 'T' };   // one extra character for the CR
+    uint16_t len = 2;
+    bool overflow = false;
+
+    void Append(char c)
+    {
+        if (len < MaxLength)
+            buf[len++] = c;
+        else
+            overflow = true;
+    }
+
+    void Append(Span s)
+    {
+        size_t n = std::min(s.Length(), size_t(MaxLength - len));
+        memcpy(buf + len, s.Pointer(), n);
+        len += n;
+        overflow |= n < s.Length();
+    }
+
+    void Append(const char* s) { Append(Span(s)); }
+    void Append(bool b) { Append(char('0' + b)); }
+
+    void Append(const ATQuoted& q)
+    {
+        Append('"');
+        Append(q.value);
+        Append('"');
+    }
+
+    template<typename T> typename std::enable_if<std::is_integral<T>::value>::type Append(T value)
+    {
+        typedef typename std::make_unsigned<T>::type U;
+        U n = U(value);
+        if (std::is_signed<T>::value && value < T(0))
+        {
+            Append('-');
+            n = U(0) - n;
+        }
+
+        char tmp[std::numeric_limits<U>::digits10 + 1];
+        char* p = tmp + sizeof(tmp);
+        do
+        {
+            *--p = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        Append(Span(p, tmp + sizeof(tmp) - p));
+    }
+};
+
+}
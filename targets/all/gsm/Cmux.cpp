@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/Cmux.cpp
+ */
+
+#include "Cmux.h"
+
+#define MYDBG(...)      DBGCL("cmux", __VA_ARGS__)
+
+namespace gsm
+{
+
+async(Cmux::Reset, Timeout timeout)
+async_def()
+{
+    // the tasks of the previous session finish once the physical link is closed
+    if (!await_mask_timeout(running, RxRunning | TxRunning, 0, timeout))
+    {
+        MYDBG("Previous session still running");
+        async_return(false);
+    }
+
+    for (auto& ch: channels)
+    {
+        ch.rx.Reset();
+        ch.tx.Reset();
+        ch.tx.BindSignal(&txSignal);
+    }
+
+    open = sendUa = sendMsc = sendMscResponse = plain = 0;
+    memset(mscSignals, 0, sizeof(mscSignals));
+    nextLink = 0;
+    closing = false;
+    async_return(true);
+}
+async_end
+
+async(Cmux::Start, Timeout timeout, unsigned links, size_t n1)
+async_def(
+    Timeout timeout;
+    uint8_t links;
+)
+{
+    ASSERT(links >= 1 && links <= Channels);
+    ASSERT(n1 >= 1 && n1 <= MaxInfo);
+    f.timeout = timeout.MakeAbsolute();
+    f.links = BIT(links + 1) - 2;
+    maxInfo = n1;
+    running = RxRunning | TxRunning;
+    kernel::Task::Run(this, &Cmux::RxTask);
+    kernel::Task::Run(this, &Cmux::TxTask);
+
+    // the control channel must be established first
+    sendSabm = BIT(0);
+    Request();
+    if (!await_mask_timeout(open, BIT(0), BIT(0), f.timeout))
+    {
+        MYDBG("Control channel not established");
+        async_return(false);
+    }
+
+    sendSabm = f.links;
+    Request();
+    if (!await_mask_timeout(open, f.links, f.links, f.timeout))
+    {
+        MYDBG("Data links not established: %02X", open);
+        async_return(false);
+    }
+
+    MYDBG("%d data links established, N1 = %d", links, maxInfo);
+    async_return(true);
+}
+async_end
+
+async(Cmux::WaitCarrierLost, unsigned dlci, Timeout timeout)
+async_def()
+{
+    async_return(await_mask_timeout(mscSignals[dlci], MscDV, 0, timeout));
+}
+async_end
+
+uint8_t Cmux::Fcs(const uint8_t* data, size_t length)
+{
+    // CRC-8 with the reversed polynomial x^8 + x^2 + x + 1, as specified by 27.010
+    uint8_t fcs = 0xFF;
+    while (length--)
+    {
+        fcs ^= *data++;
+        for (int i = 0; i < 8; i++)
+        {
+            fcs = fcs & 1 ? (fcs >> 1) ^ 0xE0 : fcs >> 1;
+        }
+    }
+    return 0xFF - fcs;
+}
+
+size_t Cmux::Frame(uint8_t* buf, unsigned dlci, uint8_t ctrl, bool command, size_t infoLength)
+{
+    ASSERT(infoLength <= MaxFrame - 6);
+    buf[0] = Flag;
+    buf[1] = dlci << 2 | (command ? AddrCR : 0) | AddrEA;
+    buf[2] = ctrl;
+    buf[3] = infoLength << 1 | 1;
+    // the FCS of UIH frames does not cover the information field
+    buf[4 + infoLength] = Fcs(buf + 1, 3);
+    buf[5 + infoLength] = Flag;
+    return 6 + infoLength;
+}
+
+size_t Cmux::DataHeader(uint8_t* buf, unsigned dlci, size_t infoLength)
+{
+    ASSERT(infoLength <= MaxInfo);
+    size_t len = 4;
+    buf[0] = Flag;
+    buf[1] = dlci << 2 | AddrCR | AddrEA;
+    buf[2] = CtrlUIH;
+    if (infoLength <= 127)
+    {
+        buf[3] = infoLength << 1 | 1;
+    }
+    else
+    {
+        // the EA bit of the first byte is cleared when the length continues in the second one
+        buf[3] = infoLength << 1;
+        buf[len++] = infoLength >> 7;
+    }
+    // the FCS of UIH frames does not cover the information field
+    buf[len] = Fcs(buf + 1, len - 1);
+    buf[len + 1] = Flag;
+    return len;
+}
+
+size_t Cmux::CloseDown(uint8_t* buf)
+{
+    buf[4] = MsgCLD | MsgCR;
+    buf[5] = 0 << 1 | 1;
+    return Frame(buf, 0, CtrlUIH, true, 2);
+}
+
+size_t Cmux::NextFrame(uint8_t* buf, unsigned& dlci, size_t& infoLength)
+{
+    uint8_t* info = buf + 4;
+    infoLength = 0;
+
+    // link management first, data only when there is nothing else to do
+    if (sendUa)
+    {
+        dlci = __builtin_ctz(sendUa);
+        sendUa &= ~BIT(dlci);
+        return Frame(buf, dlci, CtrlUA | CtrlPF, false, 0);
+    }
+
+    if (sendSabm)
+    {
+        dlci = __builtin_ctz(sendSabm);
+        sendSabm &= ~BIT(dlci);
+        return Frame(buf, dlci, CtrlSABM | CtrlPF, true, 0);
+    }
+
+    if (sendMscResponse || sendMsc)
+    {
+        bool response = sendMscResponse;
+        dlci = __builtin_ctz(response ? sendMscResponse : sendMsc);
+        (response ? sendMscResponse : sendMsc) &= ~BIT(dlci);
+        info[0] = response ? MsgMSC : MsgMSC | MsgCR;
+        info[1] = 2 << 1 | 1;
+        info[2] = dlci << 2 | AddrCR | AddrEA;
+        info[3] = response ? mscSignals[dlci] : MscSignals;
+        return Frame(buf, 0, CtrlUIH, true, 4);
+    }
+
+    for (unsigned n = 0; n < Channels; n++)
+    {
+        unsigned i = (nextLink + n) % Channels;
+        if (!IsOpen(i + 1))
+        {
+            continue;
+        }
+
+        if (size_t len = std::min(io::PipeReader(channels[i].tx).Available(), size_t(maxInfo)))
+        {
+            dlci = i + 1;
+            infoLength = len;
+            nextLink = (i + 1) % Channels;
+            return DataHeader(buf, dlci, len);
+        }
+    }
+
+    return 0;
+}
+
+void Cmux::OnControl(const uint8_t* msg, size_t length)
+{
+    if (length < 2)
+    {
+        return;
+    }
+
+    if (!(msg[0] & MsgCR))
+    {
+        // responses to our commands are not interesting,
+        // except for the close down which ends the framing
+        if (closing && msg[0] == MsgCLD)
+        {
+            MYDBG("Closed down");
+            plain |= RxRunning;
+        }
+        return;
+    }
+
+    size_t len = std::min(size_t(msg[1] >> 1), length - 2);
+    switch (msg[0] & ~MsgCR)
+    {
+        case MsgMSC:
+            if (len >= 2)
+            {
+                unsigned dlci = msg[2] >> 2;
+                if (dlci <= Channels)
+                {
+                    mscSignals[dlci] = msg[3];
+                    sendMscResponse |= BIT(dlci);
+                    Request();
+                }
+            }
+            break;
+
+        case MsgCLD:
+            MYDBG("Closed by the modem");
+            open = 0;
+            break;
+
+        default:
+            MYDBG("Control message %02X ignored", msg[0]);
+            break;
+    }
+}
+
+async(Cmux::RxTask)
+async_def(
+    size_t len;
+    uint8_t dlci, ctrl, hdr;
+)
+{
+    while (await(physRx.Require))
+    {
+        if (plain & RxRunning)
+        {
+            await(physRx.MoveTo, io::PipeWriter(channels[0].rx), physRx.Available());
+            continue;
+        }
+
+        if (uint8_t(physRx.Peek(0)) != Flag)
+        {
+            if (closing)
+            {
+                // text outside of frames after the close down, the modem is already in command mode
+                MYDBG("Closed down, no response");
+                plain |= RxRunning;
+                continue;
+            }
+            // hunting for the start of a frame
+            physRx.Advance(1);
+            continue;
+        }
+
+        if (!await(physRx.Require, 4))
+        {
+            break;
+        }
+
+        if (uint8_t(physRx.Peek(1)) == Flag)
+        {
+            // closing flag of the previous frame followed by an opening flag
+            physRx.Advance(1);
+            continue;
+        }
+
+        f.dlci = uint8_t(physRx.Peek(1)) >> 2;
+        f.ctrl = physRx.Peek(2);
+        f.len = uint8_t(physRx.Peek(3)) >> 1;
+        f.hdr = 4;
+        if (!(physRx.Peek(3) & 1))
+        {
+            // two-byte length, used only with N1 above 127
+            if (!await(physRx.Require, 5))
+            {
+                break;
+            }
+            f.len |= uint8_t(physRx.Peek(4)) << 7;
+            f.hdr = 5;
+        }
+
+        if (!(physRx.Peek(1) & AddrEA) || f.len > maxInfo)
+        {
+            physRx.Advance(1);
+            continue;
+        }
+
+        if (!await(physRx.Require, f.hdr + f.len + 2))
+        {
+            break;
+        }
+
+        {
+            uint8_t hdr[MaxHeader - 1];
+            for (unsigned i = 1; i < f.hdr; i++)
+            {
+                hdr[i - 1] = physRx.Peek(i);
+            }
+            if (uint8_t(physRx.Peek(f.hdr + f.len)) != Fcs(hdr, f.hdr - 1) || uint8_t(physRx.Peek(f.hdr + f.len + 1)) != Flag)
+            {
+                MYDBG("!! Invalid frame");
+                physRx.Advance(1);
+                continue;
+            }
+        }
+
+        physRx.Advance(f.hdr);
+        switch (f.ctrl & ~CtrlPF)
+        {
+            case CtrlUIH:
+                if (f.dlci == 0)
+                {
+                    uint8_t msg[MaxControl];
+                    size_t n = 0;
+                    for (char c: physRx.Enumerate(std::min(f.len, sizeof(msg))))
+                    {
+                        msg[n++] = c;
+                    }
+                    physRx.Advance(f.len);
+                    OnControl(msg, n);
+                }
+                else if (f.dlci <= Channels)
+                {
+                    // a link that is not being read stalls the others, just like a full pipe
+                    // stalls the physical link without the multiplexer
+                    await(physRx.MoveTo, io::PipeWriter(channels[f.dlci - 1].rx), f.len);
+                }
+                else
+                {
+                    physRx.Advance(f.len);
+                }
+                break;
+
+            case CtrlUA:
+                physRx.Advance(f.len);
+                if (f.dlci <= Channels)
+                {
+                    open |= BIT(f.dlci);
+                    if (f.dlci)
+                    {
+                        sendMsc |= BIT(f.dlci);
+                        Request();
+                    }
+                }
+                break;
+
+            case CtrlDM:
+            case CtrlDISC:
+                physRx.Advance(f.len);
+                if (f.dlci <= Channels)
+                {
+                    MYDBG("Link %d closed", f.dlci);
+                    open &= ~BIT(f.dlci);
+                    if ((f.ctrl & ~CtrlPF) == CtrlDISC)
+                    {
+                        sendUa |= BIT(f.dlci);
+                        Request();
+                    }
+                }
+                break;
+
+            case CtrlSABM:
+                physRx.Advance(f.len);
+                if (f.dlci <= Channels)
+                {
+                    open |= BIT(f.dlci);
+                    sendUa |= BIT(f.dlci);
+                    Request();
+                }
+                break;
+
+            default:
+                physRx.Advance(f.len);
+                break;
+        }
+
+        if (plain & RxRunning)
+        {
+            // nothing follows the response to the close down
+            physRx.Advance(1);
+        }
+        // otherwise the closing flag is left in place, it may also open the next frame
+    }
+
+    MYDBG("RX Stopped");
+    open = 0;
+    for (auto& ch: channels)
+    {
+        io::PipeWriter(ch.rx).Close();
+    }
+    running &= ~RxRunning;
+}
+async_end
+
+async(Cmux::TxTask)
+async_def(
+    uint8_t buf[MaxFrame];
+    size_t len;
+    unsigned dlci;
+    size_t info;
+)
+{
+    for (;;)
+    {
+        if (plain & TxRunning)
+        {
+            if ((f.len = io::PipeReader(channels[0].tx).Available()))
+            {
+                await(io::PipeReader(channels[0].tx).MoveTo, physTx, f.len);
+                continue;
+            }
+        }
+        else if (closing)
+        {
+            // anything written after Stop already goes unframed
+            f.len = CloseDown(f.buf);
+            plain |= TxRunning;
+            if (await(physTx.Write, Span(f.buf, f.len)) != (int)f.len)
+            {
+                break;
+            }
+            continue;
+        }
+        else if ((f.len = NextFrame(f.buf, f.dlci, f.info)))
+        {
+            if (await(physTx.Write, Span(f.buf, f.len)) != (int)f.len)
+            {
+                break;
+            }
+            if (f.info)
+            {
+                // the information field goes from the link to the physical link as it is,
+                // followed by the FCS and the closing flag prepared after the header
+                await(io::PipeReader(channels[f.dlci - 1].tx).MoveTo, physTx, f.info);
+                if (await(physTx.Write, Span(f.buf + f.len, 2)) != 2)
+                {
+                    break;
+                }
+            }
+            continue;
+        }
+
+        if (io::PipeReader(channels[0].tx).IsComplete())
+        {
+            if (!(plain & TxRunning))
+            {
+                // the first data link has been closed, close down the multiplexer
+                f.len = CloseDown(f.buf);
+                await(physTx.Write, Span(f.buf, f.len));
+            }
+            break;
+        }
+
+        await_acquire_zero(txSignal, 1);
+    }
+
+    MYDBG("TX Stopped");
+    physTx.Close();
+    running &= ~TxRunning;
+}
+async_end
+
+}
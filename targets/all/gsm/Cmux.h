@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/Cmux.h
+ *
+ * 3GPP TS 27.010 multiplexer (basic option) over a single serial link
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+#include <io/io.h>
+
+namespace gsm
+{
+
+//! Splits the serial link to the modem into several virtual channels
+//! using the basic option framing of 3GPP TS 27.010 (AT+CMUX=0)
+//!
+//! Each data link (DLCI 1..Channels) is exposed as a pair of pipes with
+//! the same orientation as the physical link, so the AT engine or any other
+//! consumer can use a channel in place of the serial port.
+//! DLCI 0 is the control channel handled internally.
+//!
+//! The multiplexer shuts down when the output of the first data link
+//! is closed, closing the physical link in turn. When the multiplexer
+//! is closed down using Stop, the first data link continues as a plain
+//! unframed link, so the AT engine can keep using it.
+class Cmux
+{
+public:
+    enum
+    {
+        //! Number of data links available
+        Channels = 3,
+        //! Information field length (N1) of the basic option when no other is negotiated
+        DefaultInfo = 31,
+        //! Largest supported information field length (N1), lengths above 127 take two bytes in the frame header
+        MaxInfo = 32767,
+    };
+
+    Cmux(io::DuplexPipe pipe)
+        : physRx(pipe), physTx(pipe) {}
+
+    //! Waits for the tasks of the previous session to finish and empties the pipes of the data links,
+    //! must be done before the modem is switched to multiplexer mode
+    //! @returns false if the previous session has not finished before the timeout
+    async(Reset, Timeout timeout);
+    //! Starts multiplexing over the physical link, the modem must already be in multiplexer mode
+    //! with the same information field length (N1); opens the control channel and the first data links,
+    //! the others are opened on request using Open, so that nothing arrives on links nobody reads
+    //! @returns true if the links have been established before the timeout
+    async(Start, Timeout timeout, unsigned links, size_t n1 = DefaultInfo);
+    //! Requests opening of another data link (1..Channels) while multiplexing
+    void Open(unsigned dlci) { ASSERT(dlci >= 1 && dlci <= Channels); if (!IsOpen(dlci)) { sendSabm |= BIT(dlci); Request(); } }
+    //! Closes down the multiplexer, the modem returns to command mode and the data passes
+    //! between the physical link and the first data link without framing from now on
+    void Stop() { open = 0; closing = true; Request(); }
+
+    //! Gets the pipes of the specified data link (1..Channels)
+    io::DuplexPipe Channel(unsigned dlci) { ASSERT(dlci >= 1 && dlci <= Channels); auto& ch = channels[dlci - 1]; return io::DuplexPipe(ch.rx, ch.tx); }
+    //! Checks if the specified data link (0..Channels) has been established
+    bool IsOpen(unsigned dlci) const { return open & BIT(dlci); }
+    //! Checks if the multiplexer tasks are running
+    bool IsRunning() const { return running; }
+    //! Checks if the multiplexer has been closed down using Stop
+    bool IsStopped() const { return closing; }
+    //! Waits until the modem stops reporting carrier (DCD, the DV signal of MSC) on the specified data link (1..Channels),
+    //! with AT&C1 it is reported only while the link is connected in data mode
+    //! @returns false if the carrier is still reported after the timeout
+    async(WaitCarrierLost, unsigned dlci, Timeout timeout);
+
+private:
+    enum
+    {
+        Flag = 0xF9,
+
+        //! Address field bits
+        AddrEA = 0x01,
+        AddrCR = 0x02,
+
+        //! Control field values, with the P/F bit cleared
+        CtrlSABM = 0x2F,
+        CtrlUA = 0x63,
+        CtrlDM = 0x0F,
+        CtrlDISC = 0x43,
+        CtrlUIH = 0xEF,
+        CtrlPF = 0x10,
+
+        //! Control channel message types, with the C/R bit cleared
+        MsgCLD = 0xC1,
+        MsgMSC = 0xE1,
+        MsgCR = 0x02,
+
+        //! V.24 signals reported in MSC commands: EA, RTC (DTR) and RTR (RTS)
+        MscSignals = 0x0D,
+        //! V.24 signal DV (DCD) reported by the modem in MSC commands
+        MscDV = 0x80,
+
+        //! Longest frame header, flag + address + control + two-byte length
+        MaxHeader = 5,
+        //! Longest frame built as a whole, the control frames carry at most 4 bytes of information,
+        //! the information of the data frames is passed from the links directly
+        MaxFrame = 4 + 4 + 2,
+        //! Longest control channel message processed
+        MaxControl = 32,
+
+        //! Bits of the running mask
+        RxRunning = BIT(0),
+        TxRunning = BIT(1),
+    };
+
+    struct Link
+    {
+        io::Pipe rx, tx;
+    };
+
+    io::PipeReader physRx;
+    io::PipeWriter physTx;
+    Link channels[Channels];
+
+    //! Set when there is something to transmit
+    bool txSignal = false;
+    //! Tasks that are still running
+    uint8_t running = 0;
+    //! Directions passing the data without framing after Stop, bits of the running mask
+    uint8_t plain = 0;
+    //! The multiplexer is being closed down by Stop
+    bool closing = false;
+    //! Established links, DLCI bits
+    uint8_t open = 0;
+    //! Links with a pending SABM or UA frame, DLCI bits
+    uint8_t sendSabm = 0, sendUa = 0;
+    //! Links with a pending MSC command or MSC response, DLCI bits
+    uint8_t sendMsc = 0, sendMscResponse = 0;
+    //! V.24 signals received in the last MSC command of each link, echoed in the response
+    uint8_t mscSignals[Channels + 1];
+    //! Data link to be served first by the next frame, for round-robin among the links
+    uint8_t nextLink = 0;
+    //! Negotiated maximum information field length (N1)
+    uint16_t maxInfo = DefaultInfo;
+
+    static uint8_t Fcs(const uint8_t* data, size_t length);
+    //! Completes the frame in the buffer around the information field that is already in place
+    //! @returns the total length of the frame
+    static size_t Frame(uint8_t* buf, unsigned dlci, uint8_t ctrl, bool command, size_t infoLength);
+    //! Builds the header of a data frame, followed by the FCS and closing flag that go after the information field
+    //! @returns the length of the header
+    static size_t DataHeader(uint8_t* buf, unsigned dlci, size_t infoLength);
+    //! Builds the next pending frame, or only the header of the next data frame,
+    //! whose information field is then taken from the data link
+    //! @returns the length of the frame or header, zero if there is nothing to send
+    size_t NextFrame(uint8_t* buf, unsigned& dlci, size_t& infoLength);
+    //! Builds the close down command
+    static size_t CloseDown(uint8_t* buf);
+
+    void OnControl(const uint8_t* msg, size_t length);
+    void Request() { txSignal = true; }
+
+    async(RxTask);
+    async(TxTask);
+};
+
+}
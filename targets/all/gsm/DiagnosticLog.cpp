@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/DiagnosticLog.cpp
+ */
+
+#include "DiagnosticLog.h"
+
+namespace gsm
+{
+
+void DiagnosticLog::Init(Buffer storage)
+{
+    // keep records aligned
+    auto p = (char*)(((uintptr_t)storage.Pointer() + 3) & ~3);
+    auto len = storage.Length() > size_t(p - storage.Pointer()) ? (storage.Length() - (p - storage.Pointer())) & ~3 : 0;
+    this->storage = p;
+    size = end = len < RecordSize(0) * 2 ? 0 : len;
+    head = tail = count = dropped = 0;
+}
+
+Buffer DiagnosticLog::Reserve(size_t len)
+{
+    if (!size)
+    {
+        return Buffer();
+    }
+
+    // a single record may never take more than half of the buffer
+    len = std::min(len, std::min(size_t(MaxRecord), size / 2 - sizeof(Header)));
+    size_t need = RecordSize(len);
+
+    if (!count)
+    {
+        head = tail = 0;
+        end = size;
+    }
+    else if (head + need > size)
+    {
+        // not enough space at the end of the buffer, drop the records
+        // after head (these are the oldest ones) and wrap around
+        while (count && tail >= head)
+        {
+            Drop();
+        }
+        end = head;
+        head = 0;
+    }
+
+    // drop the oldest records to make space
+    while (count && tail >= head && tail < head + need)
+    {
+        Drop();
+    }
+
+    if (!count)
+    {
+        tail = head;
+    }
+
+    return Buffer(storage + head + sizeof(Header), len);
+}
+
+void DiagnosticLog::Commit(ModemOptions::CallbackType type, size_t len)
+{
+    Header* h = At(head);
+    h->timestamp = MONO_CLOCKS / (MONO_FREQUENCY / 1000);
+    h->type = uint8_t(type);
+    h->reserved = 0;
+    h->length = len;
+    head += RecordSize(len);
+    count++;
+}
+
+bool DiagnosticLog::Peek(Record& rec) const
+{
+    if (!count)
+    {
+        return false;
+    }
+
+    Header* h = At(tail);
+    rec.timestamp = h->timestamp;
+    rec.type = ModemOptions::CallbackType(h->type);
+    rec.data = Span(h + 1, h->length);
+    return true;
+}
+
+void DiagnosticLog::Pop()
+{
+    ASSERT(count);
+    tail += RecordSize(At(tail)->length);
+    if (tail >= end)
+    {
+        tail = 0;
+        end = size;
+    }
+    if (!--count)
+    {
+        tail = head;
+    }
+}
+
+size_t DiagnosticLog::Format(Buffer out)
+{
+    char* p = out.Pointer();
+    char* e = p + out.Length();
+    Record rec;
+
+    while (Peek(rec))
+    {
+        // "<timestamp> <direction> <data>\n"
+        static const char* const dir[] = { ">> ", "<< ", "!! ", "P> ", "P< " };
+        char tmp[11];
+        char* t = tmp + sizeof(tmp);
+        uint32_t n = rec.timestamp;
+        do
+        {
+            *--t = '0' + n % 10;
+            n /= 10;
+        } while (n);
+
+        size_t tsLen = tmp + sizeof(tmp) - t;
+        size_t len = rec.data.Length();
+        if (size_t(e - p) < tsLen + 1 + 3 + len + 1)
+        {
+            if (p != out.Pointer() || out.Length() <= tsLen + 1 + 3 + 1)
+            {
+                break;
+            }
+            // the record would never fit, pass on at least its beginning
+            len = out.Length() - (tsLen + 1 + 3 + 1);
+        }
+
+        memcpy(p, t, tsLen);
+        p += tsLen;
+        *p++ = ' ';
+        memcpy(p, unsigned(rec.type) < countof(dir) ? dir[unsigned(rec.type)] : "?? ", 3);
+        p += 3;
+        memcpy(p, rec.data.Pointer(), len);
+        p += len;
+        *p++ = '\n';
+        Pop();
+    }
+
+    return p - out.Pointer();
+}
+
+}
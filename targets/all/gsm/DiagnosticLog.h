@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/DiagnosticLog.h
+ *
+ * Binary ring buffer for capturing modem diagnostic data
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+#include "ModemOptions.h"
+
+namespace gsm
+{
+
+//! Ring buffer of timestamped diagnostic records
+//!
+//! Records are stored as compact binary copies of the data, the oldest
+//! records are overwritten when the buffer is full. Text formatting is
+//! deferred until the application drains the log.
+class DiagnosticLog
+{
+public:
+    enum
+    {
+        //! Maximum length of data in a single record
+        MaxRecord = 256,
+    };
+
+    struct Record
+    {
+        //! Time of the record in milliseconds of the monotonic clock
+        uint32_t timestamp;
+        ModemOptions::CallbackType type;
+        Span data;
+    };
+
+    //! Starts capturing into the provided storage, an empty buffer disables the capture
+    void Init(Buffer storage);
+    bool Active() const { return size; }
+    //! Number of records in the log
+    size_t Count() const { return count; }
+    //! Number of records overwritten before they were drained
+    size_t Dropped() const { return dropped; }
+
+    //! Reserves space for a record with at most len bytes of data
+    Buffer Reserve(size_t len);
+    //! Finishes a record reserved using Reserve
+    void Commit(ModemOptions::CallbackType type, size_t len);
+
+    //! Gets the oldest record
+    //! @returns false if the log is empty
+    bool Peek(Record& rec) const;
+    //! Removes the oldest record
+    void Pop();
+
+    //! Formats the oldest records as text lines, removing them from the log;
+    //! a record longer than the whole buffer is truncated
+    //! @returns the number of bytes written to the buffer
+    size_t Format(Buffer out);
+
+private:
+    struct Header
+    {
+        uint32_t timestamp;
+        uint8_t type;
+        uint8_t reserved;
+        uint16_t length;
+    };
+
+    static size_t RecordSize(size_t len) { return (sizeof(Header) + len + 3) & ~3; }
+    Header* At(size_t offset) const { return (Header*)(storage + offset); }
+    //! Removes the oldest record to make space for a new one
+    void Drop() { Pop(); dropped++; }
+
+    char* storage = NULL;
+    uint32_t size = 0, end = 0, head = 0, tail = 0;
+    uint32_t count = 0, dropped = 0;
+};
+
+}
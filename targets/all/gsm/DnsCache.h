@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/DnsCache.h
+ *
+ * Cache of host name resolutions
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+#include <base/fnv1.h>
+
+//! Number of host name resolutions remembered by the modem
+#ifndef GSM_DNS_CACHE
+#define GSM_DNS_CACHE   4
+#endif
+
+namespace gsm
+{
+
+//! Small table of resolved addresses with expiry
+//!
+//! Host names are identified by their FNV-1a hash and length, the address
+//! is kept as text so it can be passed to the modem in place of the name.
+class DnsCache
+{
+public:
+    enum
+    {
+        //! Longest address that can be stored, enough for any IPv4 and most IPv6 literals
+        MaxAddress = 31,
+    };
+
+    //! Finds a valid resolution of the host name
+    //! @returns the address as a zero-terminated string, NULL if not cached or expired
+    const char* Lookup(Span host, mono_t now) const
+    {
+        auto e = Find(Key(host), host.Length());
+        return e && !Expired(*e, now) ? e->address : NULL;
+    }
+
+    //! Stores the address of the host name, valid for the specified number of seconds
+    void Store(Span host, Span address, unsigned seconds, mono_t now)
+    {
+        if (!address.Length() || address.Length() > MaxAddress)
+        {
+            return;
+        }
+
+        uint32_t key = Key(host);
+        auto e = const_cast<Entry*>(Find(key, host.Length()));
+        if (!e)
+        {
+            // replace an expired entry, or the one expiring first
+            e = &entries[0];
+            for (auto& c: entries)
+            {
+                if (Expired(c, now))
+                {
+                    e = &c;
+                    break;
+                }
+                if (Remaining(c, now) < Remaining(*e, now))
+                {
+                    e = &c;
+                }
+            }
+        }
+
+        e->key = key;
+        e->length = host.Length();
+        e->stored = now;
+        e->ttl = seconds * MONO_FREQUENCY;
+        memcpy(e->address, address.Pointer(), address.Length());
+        e->address[address.Length()] = 0;
+    }
+
+    //! Forgets the resolution of the host name, e.g. after connecting to the address failed
+    void Invalidate(Span host)
+    {
+        if (auto e = const_cast<Entry*>(Find(Key(host), host.Length())))
+        {
+            e->length = 0;
+            e->address[0] = 0;
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint32_t key;
+        uint16_t length;
+        mono_t stored, ttl;
+        char address[MaxAddress + 1];
+    };
+
+    Entry entries[GSM_DNS_CACHE] = {};
+
+    static uint32_t Key(Span host)
+    {
+        FNV1a fnv;
+        auto p = (const char*)host.Pointer();
+        for (size_t i = 0; i < host.Length(); i++)
+        {
+            fnv += p[i];
+        }
+        return fnv;
+    }
+
+    const Entry* Find(uint32_t key, size_t length) const
+    {
+        for (auto& e: entries)
+        {
+            if (e.length && e.length == length && e.key == key)
+            {
+                return &e;
+            }
+        }
+        return NULL;
+    }
+
+    static mono_t Remaining(const Entry& e, mono_t now)
+    {
+        mono_t age = now - e.stored;
+        return e.length && age < e.ttl ? e.ttl - age : 0;
+    }
+
+    static bool Expired(const Entry& e, mono_t now) { return !Remaining(e, now); }
+};
+
+}
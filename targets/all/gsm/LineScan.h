@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/LineScan.h
+ *
+ * Word-at-a-time scanning of received lines
+ */
+
+#pragma once
+
+#include <base/base.h>
+
+namespace gsm
+{
+
+//! Locates the line terminator, the first colon, the commas and the quotes
+//! of a line stored in contiguous memory in a single pass
+//!
+//! The data is processed one machine word at a time, words that do not
+//! contain any of the interesting characters are skipped as a whole
+//! using the usual SWAR zero byte detection.
+struct LineScan
+{
+    enum
+    {
+        //! Maximum number of comma positions recorded
+        MaxCommas = 15,
+    };
+
+    //! Set if the terminating CR has been found by the last Scan
+    bool valid;
+    //! Offset of the terminating CR
+    uint16_t length;
+    //! Offset of the first colon, same as length if there is none
+    uint16_t colon;
+    //! Total number of commas in the line
+    uint8_t commas;
+    //! Total number of double quotes in the line
+    uint8_t quotes;
+    //! Offsets of the first MaxCommas commas
+    uint16_t comma[MaxCommas];
+
+    //! Scans the data for a CR-terminated line
+    //! @returns false if there is no CR in the data
+    bool Scan(Span data)
+    {
+        auto p = (const char*)data.Pointer();
+        size_t len = std::min(data.Length(), size_t(UINT16_MAX));
+
+        valid = false;
+        length = 0;
+        colon = UINT16_MAX;
+        commas = 0;
+        quotes = 0;
+
+        size_t i = 0;
+        while (i < len)
+        {
+            if (!((uintptr_t)(p + i) & (sizeof(word) - 1)) && i + sizeof(word) <= len)
+            {
+                word w;
+                memcpy(&w, p + i, sizeof(w));
+                if (!(Match(w, '\r') | Match(w, ':') | Match(w, ',') | Match(w, '"')))
+                {
+                    i += sizeof(word);
+                    continue;
+                }
+            }
+
+            // process the word containing a match (or unaligned data) byte by byte
+            switch (p[i])
+            {
+                case '\r':
+                    valid = true;
+                    length = i;
+                    if (colon > i)
+                    {
+                        colon = i;
+                    }
+                    return true;
+
+                case ':':
+                    if (colon > i)
+                    {
+                        colon = i;
+                    }
+                    break;
+
+                case ',':
+                    if (commas < MaxCommas)
+                    {
+                        comma[commas] = i;
+                    }
+                    if (commas < UINT8_MAX)
+                    {
+                        commas++;
+                    }
+                    break;
+
+                case '"':
+                    if (quotes < UINT8_MAX)
+                    {
+                        quotes++;
+                    }
+                    break;
+            }
+            i++;
+        }
+
+        return false;
+    }
+
+private:
+    typedef uintptr_t word;
+
+    static constexpr word Ones = ~word(0) / 0xFF;
+    static constexpr word Highs = Ones << 7;
+
+    //! Returns non-zero if any byte of the word is equal to c
+    static word Match(word w, char c)
+    {
+        word x = w ^ (Ones * uint8_t(c));
+        return (x - Ones) & ~x & Highs;
+    }
+};
+
+}
@@ -12,6 +12,8 @@
 
 #include <collections/SelfLinkedList.h>
 
+#include "SendPolicy.h"
+
 namespace gsm
 {
 
@@ -56,6 +58,7 @@ private:
     uint8_t lenRcpt;
     uint16_t lenTxt;
     int mr = -1;
+    SendState send;
 
     bool ShouldSend() const
     {
@@ -25,6 +25,65 @@
 namespace gsm
 {
 
+//! Minimal iterator over a line in contiguous memory
+class LineCursor
+{
+public:
+    LineCursor(const char* p, size_t len) : start(p), p(p), end(p + len) {}
+
+    explicit operator bool() const { return p < end; }
+    char operator*() const { return *p; }
+    LineCursor& operator++() { ++p; return *this; }
+    size_t Offset() const { return p - start; }
+
+private:
+    const char* start;
+    const char* p;
+    const char* end;
+};
+
+//! Calculates the hash of the event header, leaving the iterator
+//! at the colon or after the comma terminating the header
+template<typename TIterator> static FNV1a LineHeader(TIterator& iter)
+{
+    FNV1a hash;
+    bool digitsOnly = true;
+    while (iter && *iter != ':')
+    {
+        if (*iter == ',')
+        {
+            if (digitsOnly)
+            {
+                // calculate hash only for text after the comma
+                // for events with channel, such as "0, CONNECT OK"
+                ++iter;
+                if (iter && *iter == ' ')
+                {
+                    ++iter;
+                }
+                hash = FNV1a();
+                continue;
+            }
+            else
+            {
+                // terminate at comma, include it in the event hash
+                // to disambiguate
+                hash += ',';
+                ++iter;
+                break;
+            }
+        }
+        else if (*iter < '0' || *iter > '9')
+        {
+            digitsOnly = false;
+        }
+
+        hash += *iter;
+        ++iter;
+    }
+    return hash;
+}
+
 async(Modem::WaitForPowerOn, Timeout timeout)
 async_def_once()
 {
@@ -47,10 +106,33 @@ async_def_once()
 }
 async_end
 
-Socket* Modem::CreateSocket(Span host, uint32_t port, bool tls)
+Socket* Modem::CreateSocket(Span host, uint32_t port, bool tls, const SocketOptions& opts)
 {
+    if (tls && opts.datagram)
+    {
+        MYDBG("TLS is not supported for datagram sockets");
+        return NULL;
+    }
+
+    if (!opts.datagram)
+    {
+        if (auto sock = AdoptSocket(host, port, tls, opts))
+        {
+            return sock;
+        }
+    }
+
     auto size = SocketSizeImpl();
-    auto sock = (Socket*)malloc(size + host.Length() + 1);
+    if (!socketPool.IsConfigured())
+    {
+        // the capacity may not be known until the modem model is detected,
+        // the pool stays unconfigured and the sockets come from the heap until then
+        if (size_t capacity = options.SocketPoolCapacity() ? options.SocketPoolCapacity() : SocketCapacityImpl())
+        {
+            socketPool.Configure(size + GSM_POOL_HOST_LENGTH + 1, capacity);
+        }
+    }
+    auto sock = (Socket*)socketPool.Allocate(size + host.Length() + 1);
     if (!sock)
         return NULL;
 
@@ -59,14 +141,19 @@ Socket* Modem::CreateSocket(Span host, uint32_t port, bool tls)
     {
         memset(sock + 1, 0, size - sizeof(Socket));
     }
-    sock->flags = SocketFlags::AppReference | (SocketFlags::AppSecure * tls);
+    sock->flags = SocketFlags::AppReference | (SocketFlags::AppSecure * tls) | (SocketFlags::AppDatagram * opts.datagram);
     sock->port = port;
+    sock->coalesceBytes = opts.coalesceBytes;
+    sock->coalesceMs = opts.coalesceMs;
+    sock->inputLimit = opts.inputLimit;
+    sock->send.policy = opts.policy;
     auto pHost = (char*)sock + size;
     memcpy(pHost, host.Pointer(), host.Length());
     pHost[host.Length()] = 0;
     sock->host = pHost;
 
     sockets.Append(sock);
+    ScheduleSocket(sock);
     signals |= Signal::RequireActive;
 
     EnsureRunning();
@@ -75,10 +162,14 @@ Socket* Modem::CreateSocket(Span host, uint32_t port, bool tls)
     return sock;
 }
 
-Message* Modem::SendMessage(Span recipient, Span text)
+Message* Modem::SendMessage(Span recipient, Span text, const SendPolicy& policy)
 {
     auto size = MessageSizeImpl();
-    auto msg = (Message*)malloc(size + recipient.Length() + text.Length());
+    if (!messagePool.IsConfigured())
+    {
+        messagePool.Configure(size + GSM_POOL_MESSAGE_LENGTH, options.MessageOutboxDepth());
+    }
+    auto msg = (Message*)messagePool.Allocate(size + recipient.Length() + text.Length());
     if (!msg)
     {
         return NULL;
@@ -96,8 +187,11 @@ Message* Modem::SendMessage(Span recipient, Span text)
     msg->lenTxt = text.Length();
     memcpy(pData, recipient.Pointer(), msg->lenRcpt);
     memcpy(pData + msg->lenRcpt, text.Pointer(), msg->lenTxt);
+    msg->send.policy = policy;
+    msg->send.Update(std::max(size_t(msg->lenTxt), size_t(1)), MONO_CLOCKS);
 
     messages.Append(msg);
+    ListWaiting(msg->send, NULL, msg);
     signals |= Signal::RequireActive;
 
     EnsureRunning();
@@ -106,13 +200,102 @@ Message* Modem::SendMessage(Span recipient, Span text)
     return msg;
 }
 
+Socket* Modem::AdoptSocket(Span host, uint16_t port, bool tls, const SocketOptions& opts)
+{
+    for (auto& s: sockets)
+    {
+        if (s.Matches(host, port, tls) && s.CanPark())
+        {
+            s.flags = (s.flags & ~SocketFlags::AppParked) | SocketFlags::AppReference;
+            s.coalesceBytes = opts.coalesceBytes;
+            s.coalesceMs = opts.coalesceMs;
+            s.inputLimit = opts.inputLimit;
+            s.coalescing = false;
+            s.send.policy = opts.policy;
+            ScheduleSocket(&s);
+            MYDBG("Socket %p to %s:%d reused", &s, s.host, s.port);
+            return &s;
+        }
+    }
+    return NULL;
+}
+
+bool Modem::CloseOldestParked()
+{
+    Socket* oldest = NULL;
+    mono_t now = MONO_CLOCKS;
+    for (auto& s: sockets)
+    {
+        if (s.IsParked() && (!oldest || now - s.parkedSince > now - oldest->parkedSince))
+        {
+            oldest = &s;
+        }
+    }
+
+    if (!oldest)
+    {
+        return false;
+    }
+
+    MYDBG("Parked socket %p closed to free a channel", oldest);
+    oldest->flags = (oldest->flags & ~SocketFlags::AppParked) | SocketFlags::AppClose;
+    ScheduleSocket(oldest);
+    return true;
+}
+
+bool Modem::IsAddressLiteral(const char* host)
+{
+    bool digits = true;
+    for (auto p = host; *p; p++)
+    {
+        if (*p == ':')
+        {
+            return true;
+        }
+        if (!(*p == '.' || (*p >= '0' && *p <= '9')))
+        {
+            digits = false;
+        }
+    }
+    return digits;
+}
+
+bool Modem::NeedsResolve(Socket& sock)
+{
+    // TLS connections keep the name, it is needed for SNI and certificate validation
+    return options.DnsCacheSeconds() && !sock.IsSecure() &&
+        !IsAddressLiteral(sock.host) && !dns.Lookup(sock.host, MONO_CLOCKS);
+}
+
+const char* Modem::ConnectHost(Socket& sock)
+{
+    if (options.DnsCacheSeconds() && !sock.IsSecure())
+    {
+        if (auto address = dns.Lookup(sock.host, MONO_CLOCKS))
+        {
+            return address;
+        }
+    }
+    return sock.host;
+}
+
 void Modem::DestroySocket(Socket* sock)
 {
     ASSERT(!sock->next);
     ASSERT(!sockets.Contains(sock));
     MYDBG("Socket %p to %s:%d destroyed", sock, sock->host, sock->port);
+    if (sock->IsAllocated())
+    {
+        FreeImpl(*sock);
+    }
+    UnscheduleSocket(sock);
+    UnlistWaiting(sock->send);
+    if (sock == dataSock)
+    {
+        dataSock = NULL;
+    }
     sock->~Socket();
-    free(sock);
+    socketPool.Free(sock);
 }
 
 void Modem::ReleaseSocket(Socket* sock)
@@ -121,19 +304,268 @@ void Modem::ReleaseSocket(Socket* sock)
     ASSERT(sock->flags & SocketFlags::AppReference);
 
     MYDBG("Socket %p to %s:%d released by app", sock, sock->host, sock->port);
+    if (options.SocketReuseMs() && sock->CanPark())
+    {
+        // keep the connection open for a while, the next socket to the same endpoint can take it over
+        sock->flags = (sock->flags & ~SocketFlags::AppReference) | SocketFlags::AppParked;
+        sock->parkedSince = MONO_CLOCKS;
+        ScheduleSocket(sock);
+        return;
+    }
+
     // mark as released and request closure
     sock->flags = (sock->flags & ~SocketFlags::AppReference) | SocketFlags::AppClose;
+    ScheduleSocket(sock);
     // we need the task to run, at least to destroy the socket
     EnsureRunning();
 }
 
+void Modem::ScheduleSocket(Socket* sock, bool wake)
+{
+    if (!sock->scheduled)
+    {
+        sock->scheduled = true;
+        sock->scheduledNext = NULL;
+        if (scheduledLast)
+        {
+            scheduledLast->scheduledNext = sock;
+        }
+        else
+        {
+            scheduledFirst = sock;
+        }
+        scheduledLast = sock;
+    }
+
+    if (wake)
+    {
+        RequestProcessing();
+    }
+}
+
+void Modem::UnscheduleSocket(Socket* sock)
+{
+    if (!sock->scheduled)
+    {
+        return;
+    }
+
+    Socket* prev = NULL;
+    for (auto s = scheduledFirst; s; prev = s, s = s->scheduledNext)
+    {
+        if (s == sock)
+        {
+            (prev ? prev->scheduledNext : scheduledFirst) = s->scheduledNext;
+            if (scheduledLast == s)
+            {
+                scheduledLast = prev;
+            }
+            break;
+        }
+    }
+    sock->scheduled = false;
+}
+
+Socket* Modem::NextScheduledSocket()
+{
+    auto sock = scheduledFirst;
+    if (sock)
+    {
+        scheduledFirst = sock->scheduledNext;
+        if (!scheduledFirst)
+        {
+            scheduledLast = NULL;
+        }
+        sock->scheduled = false;
+    }
+    return sock;
+}
+
+void Modem::ListWaiting(SendState& st, Socket* sock, Message* msg)
+{
+    if (st.listed)
+    {
+        return;
+    }
+
+    st.listed = true;
+    st.socket = sock;
+    st.message = msg;
+    st.nextWaiting = NULL;
+    (waitingLast ? waitingLast->nextWaiting : waitingFirst) = &st;
+    waitingLast = &st;
+}
+
+void Modem::UnlistWaiting(SendState& st)
+{
+    if (!st.listed)
+    {
+        return;
+    }
+
+    SendState* prev = NULL;
+    for (auto w = waitingFirst; w; prev = w, w = w->nextWaiting)
+    {
+        if (w == &st)
+        {
+            (prev ? prev->nextWaiting : waitingFirst) = w->nextWaiting;
+            if (waitingLast == w)
+            {
+                waitingLast = prev;
+            }
+            break;
+        }
+    }
+    st.listed = false;
+}
+
+void Modem::ListNewOutput()
+{
+    // the output pipes raise the shared process signal and do not tell which socket
+    // has been written to, so the sockets that are not listed are checked directly
+    for (auto& s: sockets)
+    {
+        if (!s.send.listed && s.DataToSend())
+        {
+            ListWaiting(s.send, &s, NULL);
+        }
+    }
+}
+
+template<typename F> void Modem::ForEachPendingSend(F fn)
+{
+    for (auto st = waitingFirst; st; st = st->nextWaiting)
+    {
+        if (st->Pending())
+            fn(*st);
+    }
+}
+
+bool Modem::PickNextSend(Socket*& sock, Message*& msg)
+{
+    mono_t now = MONO_CLOCKS;
+
+    // refresh the state of the waiting output, the output that has nothing more to send leaves the list
+    SendState* prev = NULL;
+    for (auto st = waitingFirst; st;)
+    {
+        auto next = st->nextWaiting;
+        if (Socket* s = st->socket)
+        {
+            if (!s->DataToSend())
+            {
+                s->send.Update(0, now);
+            }
+            else if (auto delay = std::max(s->BackoffDelay(now), s->CoalesceDelay(now)))
+            {
+                // wait for more data, but not longer than the coalescing window,
+                // or until the modem can accept more data
+                MYTRACE(TRACE_SOCKETS, "Holding %d bytes for socket %p", s->OutputPending(), s);
+                s->send.Update(s->OutputPending(), now);
+                s->send.Hold();
+                if (!coalesceWait || delay < coalesceWait)
+                {
+                    coalesceWait = delay;
+                }
+            }
+            else
+            {
+                size_t avail = s->OutputPending();
+                s->send.Update(s->packetSize ? std::min(avail, size_t(s->packetSize)) : avail, now);
+            }
+        }
+        else
+        {
+            Message* m = st->message;
+            m->send.Update(m->ShouldSend() ? std::max(size_t(m->lenTxt), size_t(1)) : 0, now);
+        }
+
+        if (!st->waiting)
+        {
+            (prev ? prev->nextWaiting : waitingFirst) = next;
+            if (waitingLast == st)
+            {
+                waitingLast = prev;
+            }
+            st->listed = false;
+        }
+        else
+        {
+            prev = st;
+        }
+        st = next;
+    }
+
+    // pick the class with the earliest deadline that is about to expire, otherwise in priority order
+    int cls = -1;
+    bool clsDeadline = false;
+    mono_t clsDue = 0;
+    ForEachPendingSend([&](SendState& st)
+    {
+        int c = int(st.policy.priority);
+        if (st.DeadlineDue(now))
+        {
+            if (!clsDeadline || st.Deadline() < clsDue)
+            {
+                cls = c;
+                clsDeadline = true;
+                clsDue = st.Deadline();
+            }
+        }
+        else if (!clsDeadline && (cls < 0 || c < cls))
+        {
+            cls = c;
+        }
+    });
+
+    if (cls < 0)
+    {
+        return false;
+    }
+
+    // deficit round robin within the class - find the queue that first accumulates
+    // enough credit for its next transmission and credit all queues for the rounds it takes
+    SendState* best = NULL;
+    uint32_t bestRounds = 0;
+    ForEachPendingSend([&](SendState& st)
+    {
+        if (int(st.policy.priority) != cls)
+            return;
+
+        int32_t quantum = SendQuantum * std::max(st.policy.weight, uint8_t(1));
+        uint32_t rounds = st.deficit >= st.cost ? 0 : (st.cost - st.deficit + quantum - 1) / quantum;
+        if (!best || rounds < bestRounds)
+        {
+            best = &st;
+            bestRounds = rounds;
+        }
+    });
+
+    if (bestRounds)
+    {
+        ForEachPendingSend([&](SendState& st)
+        {
+            if (int(st.policy.priority) == cls)
+                st.deficit += bestRounds * SendQuantum * std::max(st.policy.weight, uint8_t(1));
+        });
+    }
+
+    sock = best->socket;
+    msg = best->message;
+    best->deficit -= best->cost;
+    best->Sent(now);
+    MYTRACE(TRACE_SOCKETS, "Sending %d bytes of class %d for %p", best->cost, cls, sock ? (void*)sock : (void*)msg);
+    return true;
+}
+
 void Modem::DestroyMessage(Message* msg)
 {
     ASSERT(!msg->next);
     ASSERT(!messages.Contains(msg));
     MYDBG("Message %p to %b destroyed", msg, msg->Recipient());
+    UnlistWaiting(msg->send);
     msg->~Message();
-    free(msg);
+    messagePool.Free(msg);
 }
 
 void Modem::ReleaseMessage(Message* msg)
@@ -161,6 +593,12 @@ async(Modem::Task)
 async_def(
     union { Socket* s; Message* m; };
     union { Socket* next; Message* mNext; };
+    Socket* last;
+    Socket* sendSock;
+    Message* sendMsg;
+    unsigned sends;
+    size_t len;
+    mono_t delay;
 )
 {
     // we may not need to run, preprocess sockets to find if there is an active one
@@ -257,63 +695,134 @@ async_def(
                 GsmStatus(GsmStatus::Ok);
                 signals |= Signal::NetworkActive;    // allow connections
 
-                while (await_acquire_zero(process, 1))
+                // resolve the hosts of the sockets that have been waiting for the network
+                // all at once, later sockets to the same host find them in the cache
+                for (f.s = sockets.First(); f.s && !rxLen; f.s = f.s->next)
+                {
+                    if (NeedsResolve(*f.s))
+                    {
+                        await(ResolveImpl, f.s->host);
+                    }
+                }
+
+                // process all existing sockets in the first pass
+                for (auto& s: sockets)
+                {
+                    ScheduleSocket(&s);
+                }
+
+                while (await(WaitProcessing))
                 {
                     MYTRACE(TRACE_SOCKETS, "Processing...");
+                    coalesceWait = 0;
+
+                    if (!!(signals & Signal::DataMode) && (ATWaiting() || !!(signals & Signal::DataSuspect)))
+                    {
+                        // other tasks need to execute commands, or the connection may have been lost,
+                        // which the escape confirms
+                        await(ATEscapeData);
+                    }
 
-                    // disconnect sockets
-                    for (f.s = sockets.First(); f.s && !rxLen; f.s = f.next)
+                    // process the sockets scheduled after a state change, sockets scheduled
+                    // during this pass are processed in the next one
+                    for (f.last = scheduledLast; f.last && !rxLen;)
                     {
-                        f.next = f.s->next;
-                        if (f.s->NeedsClose())
+                        f.s = NextScheduledSocket();
+                        if (f.s == f.last)
+                        {
+                            f.last = NULL;
+                        }
+
+                        if (f.s->IsParked())
+                        {
+                            mono_t idle = MONO_CLOCKS - f.s->parkedSince;
+                            mono_t limit = options.SocketReuseMs() * (MONO_FREQUENCY / 1000);
+                            if (idle < limit && f.s->CanPark())
+                            {
+                                // check again when the idle time expires
+                                ScheduleSocket(f.s, false);
+                                if (!coalesceWait || limit - idle < coalesceWait)
+                                {
+                                    coalesceWait = limit - idle;
+                                }
+                                continue;
+                            }
+
+                            // expired, or something arrived that the next user would not expect
+                            MYDBG("Parked socket %p closed", f.s);
+                            f.s->flags = (f.s->flags & ~SocketFlags::AppParked) | SocketFlags::AppClose;
+                        }
+
+                        if (f.s->NeedsClose() && (f.delay = f.s->CloseDelay(MONO_CLOCKS)))
+                        {
+                            // the output held back by coalescing is sent later in this pass, close afterwards
+                            MYTRACE(TRACE_SOCKETS, "Flushing %d bytes before closing socket %p", f.s->OutputPending(), f.s);
+                            ScheduleSocket(f.s, false);
+                            if (!coalesceWait || f.delay < coalesceWait)
+                            {
+                                coalesceWait = f.delay;
+                            }
+                        }
+                        else if (f.s->NeedsClose())
                         {
                             f.s->flags |= SocketFlags::ModemClosing;
                             MYDBG("Closing socket %p", f.s);
                             await(CloseImpl, *f.s);
                         }
-                    }
 
-                    // remove unused sockets
-                    for (auto& manip: sockets.Manipulate())
-                    {
-                        if (manip.Element().CanDelete())
+                        if (f.s->CanDelete())
                         {
-                            // delete socket
-                            DestroySocket(&manip.Remove());
+                            for (auto& manip: sockets.Manipulate())
+                            {
+                                if (&manip.Element() == f.s)
+                                {
+                                    DestroySocket(&manip.Remove());
+                                    break;
+                                }
+                            }
+                            // a channel may have been freed for another socket
+                            RequestProcessing();
+                            continue;
                         }
-                    }
 
-                    // process other operations (allocate, connect, send)
-                    for (f.s = sockets.First(); f.s && !rxLen; f.s = f.s->next)
-                    {
-                        if (!f.s->IsAllocated())
+                        if (!f.s->IsAllocated() && !f.s->IsClosed() && !TryAllocateImpl(*f.s))
                         {
-                            TryAllocateImpl(*f.s);
+                            // no free channel, a parked connection gives way to a socket that is actually used;
+                            // the destruction of any socket requests processing, which retries the allocation
+                            CloseOldestParked();
+                            ScheduleSocket(f.s, false);
                         }
 
-                        if (f.s->NeedsConnect())
+                        if (f.s->NeedsConnect() && NeedsResolve(*f.s))
                         {
-                            f.s->flags |= SocketFlags::ModemConnecting;
-                            await(ConnectImpl, *f.s);
+                            // the modem resolves the name itself if this fails
+                            await(ResolveImpl, f.s->host);
                         }
 
-                        if (f.s->DataToSend())
+                        if (f.s->NeedsConnect())
                         {
-                            await(SendPacketImpl, *f.s);
-                            // always continue processing after send attempt
-                            RequestProcessing();
+                            f.s->Connecting();
+                            await(ConnectImpl, *f.s);
                         }
 
                         if (f.s->DataToReceive())
                         {
                             if (f.s->CanReceive())
                             {
+                                f.s->ResumeReceive();
                                 await(ReceivePacketImpl, *f.s);
                             }
-                            else
+                            else if (!f.s->IsReceiveParked() && !f.s->InputSpace())
+                            {
+                                // the application has not consumed the previously received data yet,
+                                // Socket::Consume or the input pipe will request processing once there is free space
+                                MYTRACE(TRACE_SOCKETS, "Receive parked for socket %p", f.s);
+                                f.s->ParkReceive(&process);
+                            }
+
+                            if (f.s->IsReceiveParked())
                             {
-                                // TODO: wait until the socket can receive data instead of polling
-                                RequestProcessing();
+                                ScheduleSocket(f.s, false);
                             }
                         }
 
@@ -323,34 +832,78 @@ async_def(
                         }
                     }
 
-                    // send messages
-                    for (f.m = messages.First(); f.m && !rxLen; f.m = f.m->next)
+                    // send a burst of packets and messages, each choice is made over the refreshed
+                    // list of waiting output, stop early when sockets change state or other tasks need the modem
+                    ListNewOutput();
+                    for (f.sends = 0; f.sends < SendBurst && !rxLen && !scheduledFirst && !ATWaiting(); f.sends++)
                     {
-                        if (f.m->ShouldSend())
+                        f.sendSock = NULL;
+                        f.sendMsg = NULL;
+                        if (!PickNextSend(f.sendSock, f.sendMsg))
                         {
-                            if (!await(SendMessageImpl, *f.m))
-                            {
-                                f.m->SendingFailed();
-                            }
-                            // always continue processing after send attempt
-                            RequestProcessing();
+                            break;
                         }
-                    }
 
-                    // remove processed messages
-                    for (auto& manip: messages.Manipulate())
-                    {
-                        if (manip.Element().CanDelete())
+                        if (f.sendSock)
                         {
-                            DestroyMessage(&manip.Remove());
+                            await(SendPacketImpl, *f.sendSock);
+                        }
+                        else if (!await(SendMessageImpl, *f.sendMsg))
+                        {
+                            f.sendMsg->SendingFailed();
                         }
+                        // always continue processing after send attempt
+                        RequestProcessing();
                     }
 
-                    if (atResult != ATResult::OK)
+                    if (dataSock && !rxLen)
                     {
-                        MYDBG("AT sequence broken");
-                        break;
-                    }
+                        if (!(signals & Signal::ATLock) && ATWaiting())
+                        {
+                            // a waiting task takes the free lock as soon as it runs, let it do so,
+                            // if the flag has been left behind by an operation that is gone, it is cleared now
+                            signals &= ~Signal::ATWanted;
+                            RequestProcessing();
+                        }
+                        else if (!(signals & Signal::DataMode) && dataSock->IsConnected() && !dataSock->NeedsClose() &&
+                            !(dataSock->flags & SocketFlags::ModemClosing) && !messages && !ATWaiting() &&
+                            modemStatus != ModemStatus::CommandError && !await(ATResumeData))
+                        {
+                            MYDBG("!! Failed to resume data mode");
+                            dataSock->flags &= ~SocketFlags::ModemDataMode;
+                            dataSock->Disconnected();
+                            dataSock = NULL;
+                        }
+
+                        if (!!(signals & Signal::DataMode) && (f.len = dataSock->OutputReader().Available()))
+                        {
+                            // transparent mode, the output goes directly to the modem
+                            await(dataSock->OutputReader().MoveTo, tx, f.len);
+                        }
+
+                        if (!!(signals & Signal::DataMode) && ATWaiting())
+                        {
+                            // someone started waiting for the lock while we were entering the data mode
+                            RequestProcessing();
+                        }
+                    }
+
+                    // remove processed messages
+                    for (auto& manip: messages.Manipulate())
+                    {
+                        if (manip.Element().CanDelete())
+                        {
+                            DestroyMessage(&manip.Remove());
+                        }
+                    }
+
+                    // an error response restarts the modem as before,
+                    // only a broken command/response sequence is worth resynchronizing
+                    if (atResult != ATResult::OK && (modemStatus != ModemStatus::CommandError || !await(ATResync)))
+                    {
+                        MYDBG("AT sequence broken");
+                        break;
+                    }
 
                     if (!sockets && !messages)
                     {
@@ -389,6 +942,8 @@ async_def(
     options.OnPowerOff();
     PowerDiagnostic(ModemOptions::CallbackType::PowerReceive, "OFF");
 
+    // nobody is going to decide about the data held back by the receiver anymore
+    signals &= ~(Signal::DataMode | Signal::DataSuspect);
     await_mask(signals, Signal::RxTaskActive, 0);
 
     signals &= ~Signal::TaskActive;
@@ -402,14 +957,63 @@ async_def(
 }
 async_end
 
+async(Modem::WaitProcessing)
+async_def()
+{
+    if (coalesceWait && !process)
+    {
+        // some output is being held back, process it when the coalescing window expires
+        unsigned ms = (coalesceWait + MONO_FREQUENCY / 1000 - 1) / (MONO_FREQUENCY / 1000);
+        if (!await_mask_timeout(process, true, true, Timeout::Milliseconds(ms)))
+        {
+            process = true;
+        }
+    }
+
+    async_return(await_acquire_zero(process, 1));
+}
+async_end
+
 async(Modem::RxTask)
 async_def(
     FNV1a hash;
     size_t len;
+    size_t tail;
+    uint8_t header[Socket::DatagramHeader];
 )
 {
     while (await(rx.Require))
     {
+        if (!!(signals & Signal::DataMode))
+        {
+            // transparent mode, everything received belongs to the socket,
+            // except for the notification of the lost connection
+            f.len = rx.Available();
+            f.tail = DataLostNotification(rx, f.len);
+            if (f.len > f.tail)
+            {
+                if (dataSock)
+                {
+                    await(rx.MoveTo, dataSock->InputWriter(), f.len - f.tail);
+                }
+                else
+                {
+                    rx.Advance(f.len - f.tail);
+                }
+            }
+
+            if (f.tail)
+            {
+                // the notification may as well be a part of the data, it is held back
+                // until the task holding the data mode finds out by escaping from it
+                atDataTail = f.tail;
+                signals |= Signal::DataSuspect;
+                RequestProcessing();
+                await_mask(signals, Signal::DataSuspect, 0);
+            }
+            continue;
+        }
+
         // need at least one character
         switch (rx.Peek(0))
         {
@@ -418,9 +1022,15 @@ async_def(
                 if (atTransmitSock)
                 {
                     MYTRACE(TRACE_SOCKETS, "[%p] >> sending %d+%d=%d", atTransmitSock, atTransmitSock->OutputReader().Position(), atTransmitLen, atTransmitSock->OutputReader().Position() + atTransmitLen);
-                    UNUSED size_t sent = await(atTransmitSock->OutputReader().CopyTo, tx, 0, atTransmitLen);
+                    UNUSED size_t sent = await(atTransmitSock->OutputReader().CopyTo, tx, atTransmitOffset, atTransmitLen);
                     ASSERT(sent == atTransmitLen);
                     atTransmitSock = NULL;
+                    if (atTransmitComplete && atResult == ATResult::Pending)
+                    {
+                        // the confirmation arrives later as an event
+                        atComplete = 0;
+                        ATComplete(atRequire);
+                    }
                 }
                 else if (atTransmitMsg)
                 {
@@ -445,8 +1055,14 @@ async_def(
                 break;
 
             default:
-                // EOL-terminated command
-                size_t len = await(rx.RequireUntil, '\r');
+                // EOL-terminated command, look for the end of line in the contiguous
+                // part of the buffer first and wait for more data only if needed
+                size_t len = lineScan.Scan(rx.GetSpan()) ? lineScan.length + 1 : await(rx.RequireUntil, '\r');
+                if (len && !lineScan.valid)
+                {
+                    // try again, the complete line may be contiguous now
+                    lineScan.Scan(rx.GetSpan());
+                }
                 if (!len)
                 {
                     if (rx.IsComplete())
@@ -458,56 +1074,90 @@ async_def(
                 }
 
                 lineEnd = rx.Position() + len;
+
+                if (atExpectConnect && rx.Matches("CONNECT") &&
+                    (len == 8 || rx.Matches("CONNECT FAIL") || (rx.Peek(7) == ' ' && rx.Peek(8) >= '0' && rx.Peek(8) <= '9')))
+                {
+                    // CONNECT [<rate>] switches to data mode right after the line,
+                    // CONNECT FAIL is the failure of the transparent connection
+                    MYTRACE(TRACE_AT, "<< %b", rx.GetSpan().Left(len - 1));
+                    atExpectConnect = false;
+                    if (rx.Matches("CONNECT FAIL"))
+                    {
+                        atResult = ATResult::Error;
+                        rx.AdvanceTo(lineEnd);
+                        break;
+                    }
+
+                    signals |= Signal::DataMode;
+                    atComplete = 0;
+                    ATComplete(atRequire);
+                    rx.AdvanceTo(lineEnd);
+                    if (await(rx.Require) && rx.Peek(0) == '\n')
+                    {
+                        rx.Advance(1);
+                    }
+                    break;
+                }
 #if TRACE && (MODEM_TRACE & TRACE_AT)
                 DBGC("gsm", "<< ");
                 for (char c: rx.Enumerate(len - 1)) _DBGCHAR(c);
                 _DBGCHAR('\n');
 #endif
-                if (Buffer buf = options.GetDiagnosticBuffer(ModemOptions::CallbackType::CommandReceive))
+                if (Buffer buf = DiagnosticBuffer(ModemOptions::CallbackType::CommandReceive, len - 1))
+                {
+                    DiagnosticCommit(ModemOptions::CallbackType::CommandReceive, rx.Peek(buf.Left(len - 1)));
+                }
+                if (!lineScan.valid && len <= sizeof(lineCopy))
+                {
+                    // the line is split between pipe segments, work with a copy
+                    lineScan.Scan(rx.Peek(Buffer(lineCopy, len)));
+                    lineData = lineCopy;
+                }
+                else
+                {
+                    lineData = (const char*)rx.GetSpan().Pointer();
+                }
+
+                rxLines++;
+                bool stale = !!(signals & Signal::Resync) && !atResyncEcho;
+                if (stale && len - 1 == atCommand.Command().Length() && rx.Matches(atCommand.Command()))
                 {
-                    options.DiagnosticCallback(ModemOptions::CallbackType::CommandReceive, rx.Peek(buf.Left(len - 1)));
+                    // echo of the resynchronization sentinel,
+                    // the following responses are in sync again
+                    atResyncEcho = true;
+                    rx.AdvanceTo(lineEnd);
+                    break;
                 }
+
                 FNV1a hash;
+                size_t header = 0;
                 auto iter = rx.Enumerate(len - 1);
-                bool digitsOnly = true;
-                while (iter && *iter != ':')
+                if (lineScan.valid)
                 {
-                    if (*iter == ',')
-                    {
-                        if (digitsOnly)
-                        {
-                            // calculate hash only for text after the comma
-                            // for events with channel, such as "0, CONNECT OK"
-                            ++iter;
-                            if (iter && *iter == ' ')
-                            {
-                                ++iter;
-                            }
-                            hash = FNV1a();
-                            continue;
-                        }
-                        else
-                        {
-                            // terminate at comma, include it in the event hash
-                            // to disambiguate
-                            hash += ',';
-                            ++iter;
-                            break;
-                        }
-                    }
-                    else if (*iter < '0' || *iter > '9')
+                    // calculate the hash directly in memory, then just move the iterator
+                    LineCursor cursor(lineData, lineScan.colon);
+                    hash = LineHeader(cursor);
+                    header = cursor.Offset();
+                    for (size_t n = header; n; n--)
                     {
-                        digitsOnly = false;
+                        ++iter;
                     }
-
-                    hash += *iter;
-                    ++iter;
+                }
+                else
+                {
+                    // very long line, field index is not available
+                    hash = LineHeader(iter);
                 }
 
                 switch (hash)
                 {
                     case fnv1a("OK"):
-                        if (atResult == ATResult::Pending)
+                        if (stale)
+                        {
+                            MYDBG("!! Discarding stale OK");
+                        }
+                        else if (atResult == ATResult::Pending)
                         {
                             ATComplete();
                         }
@@ -520,7 +1170,11 @@ async_def(
                     case fnv1a("ERROR"):
                     case fnv1a("+CME ERROR"):
                     case fnv1a("+CMS ERROR"):
-                        if (int(atResult) < 0)
+                        if (stale)
+                        {
+                            MYDBG("!! Discarding stale Error");
+                        }
+                        else if (int(atResult) < 0)
                         {
                             atResult = ATResult::Error;
                             async_yield();  // let the task sending the command see the error
@@ -533,16 +1187,19 @@ async_def(
                         if (*iter == ':')
                         {
                             ++iter;
+                            header++;
                             if (iter && *iter == ' ')
                             {
                                 ++iter;
+                                header++;
                             }
                         }
-                        lineFields = iter;
+                        lineFields = lineFieldStart = iter;
+                        IndexFields(header);
                         f.hash = hash;
-                        if (!await(OnEvent, f.hash))
+                        if (!await(OnEvent, f.hash) && !await(DispatchURC, f.hash))
                         {
-                            if (int(atResult) >= 0) // not pending
+                            if (int(atResult) >= 0 || stale) // not pending
                             {
                                 MYDBG("!! unexpected event");
                             }
@@ -558,6 +1215,15 @@ async_def(
                         break;
                 }
                 rx.AdvanceTo(lineEnd);
+                if (atSwitch && atResult == ATResult::OK)
+                {
+                    // the link switches to the new framing right after the OK,
+                    // the rest of the old pipe belongs to whoever handles the new framing
+                    MYDBG("Switching pipe");
+                    rx = io::PipeReader(atSwitchTo);
+                    tx = io::PipeWriter(atSwitchTo);
+                    atSwitch = false;
+                }
                 if (rxLen)
                 {
                     // skip '\n'
@@ -573,6 +1239,13 @@ async_def(
                     if (rxSock)
                     {
                         MYTRACE(TRACE_SOCKETS, "[%p] << receiving %d+%d=%d", rxSock, rxSock->InputWriter().Position(), rxLen, rxSock->InputWriter().Position() + rxLen);
+                        if (rxSock->IsDatagram())
+                        {
+                            // each received packet is a single datagram, prefix it with its length
+                            f.header[0] = rxLen;
+                            f.header[1] = rxLen >> 8;
+                            await(rxSock->InputWriter().Write, Span(f.header, Socket::DatagramHeader));
+                        }
                     }
                     else
                     {
@@ -581,7 +1254,8 @@ async_def(
 
                     do
                     {
-                        // read at least one full segment of data
+                        // wait until the rest of the payload or at least one full segment
+                        // is available, so that we don't chop segments still being filled
                         while (rx.Available() < rxLen && !rx.AvailableFullSegment())
                         {
                             f.len = rx.Available() + 1;
@@ -591,12 +1265,16 @@ async_def(
                             }
                         }
 
-                        f.len = std::min(rxLen, rx.GetSpan().Length());
+                        // hand over the rest of the payload once it is complete, otherwise only the complete
+                        // segment at the read position, MoveTo transfers the complete segments to the socket pipe
+                        // and copies only the partial segments at the edges of the payload, the segment still
+                        // being filled must not be split, as the following moves would be misaligned
+                        f.len = rx.Available() >= rxLen ? rxLen : std::min(rxLen, rx.GetSpan().Length());
                         if (!f.len)
                         {
                             break;
                         }
-                        MYTRACE(TRACE_DATA, "[%p] [%d@%p] << %H", rxSock, rx.Position(), rx.GetSpan().Pointer(), rx.GetSpan().Left(f.len));
+                        MYTRACE(TRACE_DATA, "[%p] [%d@%p] << %d: %H", rxSock, rx.Position(), rx.GetSpan().Pointer(), f.len, rx.GetSpan().Left(std::min(f.len, rx.GetSpan().Length())));
                         if (rxSock)
                         {
                             await(rx.MoveTo, rxSock->InputWriter(), f.len);
@@ -626,6 +1304,12 @@ async_end
 async(Modem::ATLock)
 async_def()
 {
+    if (!!(signals & Signal::DataMode) && atTask == &kernel::Task::Current())
+    {
+        // return to command mode, this releases the lock
+        await(ATEscapeData);
+    }
+
     if (!!(signals & Signal::ATLock))
     {
         if (atTask == &kernel::Task::Current())
@@ -634,7 +1318,8 @@ async_def()
         }
     }
 
-    if (modemStatus == ModemStatus::CommandError)
+    if (modemStatus == ModemStatus::CommandError &&
+        (!(signals & Signal::NetworkActive) || !!(signals & Signal::Resync) || !await(ATResync)))
     {
         // we cannot continue executing commands once a command failed,
         // as the ordering in the AT protocol can be broken
@@ -642,7 +1327,30 @@ async_def()
         async_return(true);
     }
 
-    await_acquire(signals, Signal::ATLock);
+    while (!!(signals & Signal::ATLock))
+    {
+        // the flag is cleared by whoever gets the lock next and set again by the tasks
+        // that are still waiting, so it does not stay behind a waiter that is gone
+        signals |= Signal::ATWanted;
+        if (!!(signals & Signal::DataMode))
+        {
+            // the modem task will leave the data mode once it notices us waiting
+            RequestProcessing();
+        }
+        await_mask(signals, Signal::ATLock, 0);
+    }
+
+    signals |= Signal::ATLock;
+    signals &= ~Signal::ATWanted;
+
+    if (modemStatus == ModemStatus::CommandError)
+    {
+        // a command failed while we were waiting
+        signals &= ~Signal::ATLock;
+        atResult = ATResult::Failure;
+        async_return(true);
+    }
+
     atTask = &kernel::Task::Current();
     atResult = ATResult::Pending;
     atRequire = 1;
@@ -651,6 +1359,108 @@ async_def()
 }
 async_end
 
+async(Modem::ATResync)
+async_def(
+    unsigned attempt;
+)
+{
+    // take the lock directly, bypassing the checks of ATLock
+    await_mask(signals, Signal::ATLock, 0);
+    signals |= Signal::ATLock;
+    atTask = &kernel::Task::Current();
+
+    if (modemStatus != ModemStatus::CommandError)
+    {
+        // already resynchronized by another task
+        ATUnlock();
+        async_return(true);
+    }
+
+    signals |= Signal::Resync;
+
+    for (f.attempt = 0; f.attempt < 3; f.attempt++)
+    {
+        MYDBG("Resynchronizing AT sequence, attempt %d...", f.attempt + 1);
+        atResyncEcho = false;
+        atTransmitSock = NULL;
+        atTransmitMsg = NULL;
+
+        // ESC aborts any data the modem may be still waiting for after a prompt,
+        // CR terminates any partially transmitted command
+        if (await(tx.Write, "\x1B\r") != 2)
+        {
+            break;
+        }
+
+        // let late responses arrive, they are discarded
+        await(RxWaitQuiet);
+
+        // turn echo on, so we can recognize the sentinel command
+        if (await(tx.Write, "ATE1\r") != 5)
+        {
+            break;
+        }
+
+        await(RxWaitQuiet);
+
+        // the sentinel consists of no-op V1 commands, their count makes
+        // the echo unique for each attempt, E0 then turns the echo back off
+        switch (atResyncSeq++ % 4)
+        {
+            case 0: atCommand.Format("V1E0"); break;
+            case 1: atCommand.Format("V1V1E0"); break;
+            case 2: atCommand.Format("V1V1V1E0"); break;
+            default: atCommand.Format("V1V1V1V1E0"); break;
+        }
+
+        MYTRACE(TRACE_AT, ">> %b", atCommand.Command());
+        atResult = ATResult::Pending;
+        atRequire = 1;
+        atComplete = 0;
+        if (await(tx.Write, atCommand.Line()) != (int)atCommand.Line().Length())
+        {
+            break;
+        }
+
+        if (await_mask_not_timeout(atResult, 0x80, 0x80, atTimeout) && atResyncEcho && atResult == ATResult::OK)
+        {
+            MYDBG("AT sequence resynchronized");
+            ModemStatus(ModemStatus::Ok);
+            break;
+        }
+    }
+
+    if (modemStatus == ModemStatus::CommandError)
+    {
+        MYDBG("AT sequence resynchronization failed");
+        atResult = ATResult::Failure;
+    }
+
+    signals &= ~Signal::Resync;
+    ATUnlock();
+    async_return(modemStatus != ModemStatus::CommandError);
+}
+async_end
+
+async(Modem::RxWaitQuiet)
+async_def(
+    unsigned i;
+    uint8_t lines;
+)
+{
+    // wait until no line is received for a while,
+    // but don't wait forever if the modem keeps talking
+    for (f.i = 0; f.i < 20; f.i++)
+    {
+        f.lines = rxLines;
+        if (!await_mask_not_timeout(rxLines, 0xFF, f.lines, Timeout::Milliseconds(200)))
+        {
+            break;
+        }
+    }
+}
+async_end
+
 async(Modem::AT, Span cmd)
 async_def()
 {
@@ -661,26 +1471,22 @@ async_def()
 
     MYTRACE(TRACE_AT, ">> AT%b", cmd);
 
-    if (Buffer buf = options.GetDiagnosticBuffer(ModemOptions::CallbackType::CommandSend))
+    if (Buffer buf = DiagnosticBuffer(ModemOptions::CallbackType::CommandSend, cmd.Length() + 2))
     {
         if (buf.Length() >= 2)
         {
             buf.Element<uint16_t>() = *(uint16_t*)"AT";
             cmd.CopyTo(buf.RemoveLeft(2));
-            options.DiagnosticCallback(ModemOptions::CallbackType::CommandSend, buf.Left(cmd.Length() + 2));
+            DiagnosticCommit(ModemOptions::CallbackType::CommandSend, buf.Left(cmd.Length() + 2));
         }
     }
 
+    ATStarted(&cmd);
     if (await(tx.Write, "AT") != 2 ||
         await(tx.Write, cmd) != (int)cmd.Length() ||
         await(tx.Write, "\r") != 1)
     {
-        atNextTimeout = Timeout::Infinite;
-        atResponse = {};
-        atTask = NULL;
-        signals &= ~Signal::ATLock;
-        ModemStatus(ModemStatus::CommandError);
-        async_return(int(atResult = ATResult::Failure));
+        async_return(ATWriteFailed());
     }
 
     async_return(await(ATResponse));
@@ -704,7 +1510,7 @@ async_def()
     _DBGCHAR('\n');
 #endif
 
-    if (Buffer buf = options.GetDiagnosticBuffer(ModemOptions::CallbackType::CommandSend))
+    if (Buffer buf = DiagnosticBuffer(ModemOptions::CallbackType::CommandSend, DiagnosticLog::MaxRecord))
     {
         if (buf.Length() >= 2)
         {
@@ -712,95 +1518,712 @@ async_def()
             va_copy(va3, va);
             buf.Element<uint16_t>() = *(uint16_t*)"AT";
             auto res = buf.RemoveLeft(2).FormatVA(format, va3);
-            options.DiagnosticCallback(ModemOptions::CallbackType::CommandSend, Buffer(buf.Pointer(), res.end()));
+            DiagnosticCommit(ModemOptions::CallbackType::CommandSend, Buffer(buf.Pointer(), res.end()));
+            va_end(va3);
         }
     }
 
+    {
+        // the prefix of the format is the same as of the formatted command, no need to format it
+        Span cmd = format ? Span(format) : Span();
+        ATStarted(&cmd);
+    }
     if (await(tx.Write, "AT") != 2 ||
         (format && format[0] && await(tx.WriteFV, Timeout::Infinite, format, va) <= 0) ||
         await(tx.Write, "\r") != 1)
     {
-        atNextTimeout = Timeout::Infinite;
-        atResponse = {};
-        atTask = NULL;
-        signals &= ~Signal::ATLock;
-        ModemStatus(ModemStatus::CommandError);
-        async_return(int(atResult = ATResult::Failure));
+        async_return(ATWriteFailed());
     }
 
     async_return(await(ATResponse));
 }
 async_end
 
-async(Modem::ATResponse)
-async_def(
-    Timeout timeout;
-)
+async(Modem::ATExecute)
+async_def()
 {
-    ASSERT(signals & Signal::ATLock);
-    ASSERT(atTask == &kernel::Task::Current());
+    if (await(ATLock))
+    {
+        async_return(int(ATResult::Failure));
+    }
 
-    f.timeout = (atNextTimeout || atTimeout).MakeAbsolute();
-    atNextTimeout = Timeout::Infinite;
+    if (atCommand.Overflow())
+    {
+        // nothing has been sent yet, the AT sequence is still intact
+        MYDBG("!! AT command too long: %b", atCommand.Command());
+        ATUnlock();
+        async_return(int(atResult = ATResult::Error));
+    }
 
-    if (!await_mask_not_timeout(atResult, 0x80, 0x80, f.timeout))
+    MYTRACE(TRACE_AT, ">> %b", atCommand.Command());
+
+    if (Buffer buf = DiagnosticBuffer(ModemOptions::CallbackType::CommandSend, atCommand.Command().Length()))
     {
-        ModemStatus(ModemStatus::CommandError);
-        atResult = ATResult::Timeout;
+        DiagnosticCommit(ModemOptions::CallbackType::CommandSend, atCommand.Command().CopyTo(buf));
     }
 
-    atResponse = {};
-    atTask = NULL;
-    signals &= ~Signal::ATLock;
-    async_return(int(atResult));
+    {
+        Span cmd = atCommand.Body();
+        ATStarted(&cmd);
+    }
+    if (await(tx.Write, atCommand.Line()) != (int)atCommand.Line().Length())
+    {
+        async_return(ATWriteFailed());
+    }
+
+    async_return(await(ATResponse));
 }
 async_end
 
-unsigned Modem::InputFieldCount() const
+async(Modem::ATConnectData, Socket& sock)
+async_def()
 {
-    unsigned n = 0;
-    bool empty = true;
-
-    for (char c: lineFields)
+    if (await(ATLock))
     {
-        empty = false;
-        if (c == ',')
-        {
-            n++;
-        }
+        async_return(int(ATResult::Failure));
     }
 
-    if (!empty)
-        n++;
+    // completed by RxTask when CONNECT arrives, a preceding OK is ignored
+    atRequire = 2;
+    atExpectConnect = true;
+    auto res = (ATResult)await(ATExecute);
+    atExpectConnect = false;
 
-    return n;
+    if (res == ATResult::OK)
+    {
+        ASSERT(signals & Signal::DataMode);
+        MYDBG("Socket %p in data mode", &sock);
+        dataSock = &sock;
+        sock.flags |= SocketFlags::ModemDataMode;
+    }
+    async_return(int(res));
 }
+async_end
 
-bool Modem::InputFieldNum(int& res, unsigned base)
+async(Modem::ATSwitchPipe, io::DuplexPipe pipe)
+async_def()
 {
-    res = 0;
-    auto iter = lineFields;
+    if (await(ATLock))
+    {
+        async_return(int(ATResult::Failure));
+    }
 
-    bool neg = false;
+    // picked up by RxTask when processing the OK response
+    atSwitchTo = pipe;
+    atSwitch = true;
+    auto res = (ATResult)await(ATExecute);
+    atSwitch = false;
+    async_return(int(res));
+}
+async_end
 
-    if (iter && (*iter == '+' || (neg = *iter == '-')))
-        ++iter;
+async(Modem::ATEscapeData)
+async_def(
+    bool success;
+)
+{
+    ASSERT(signals & Signal::DataMode);
+    ASSERT(atTask == &kernel::Task::Current());
 
-    bool hasDigit = false;
-    bool error = false;
-    while (iter)
+    MYDBG("Leaving data mode");
+    // the escape sequence must be surrounded by silence,
+    // the data still arriving until then is passed to the socket
+    async_delay_ms(EscapeGuardMs);
+    if (!!(signals & Signal::DataSuspect) && rx.Available() > atDataTail)
     {
-        char c = *iter;
-        size_t digit;
-
-        if (c >= '0' && c <= '9')
-            digit = c - '0';
-        else if (c >= 'a' && c <= 'z')
-            digit = c + 10 - 'a';
-        else if (c >= 'A' && c <= 'Z')
-            digit = c + 10 - 'A';
-        else
-            break;
+        // more data has followed the suspected notification, so it is a part of the data
+        await(PassDataTail, rx.Available());
+    }
+    signals &= ~Signal::DataMode;
+
+    atResult = ATResult::Pending;
+    atRequire = 1;
+    atComplete = 0;
+    atResponse = {};
+    f.success = await(tx.Write, "+++") == 3;
+
+    if (!!(signals & Signal::DataSuspect))
+    {
+        // the modem responds to the escape sequence only if it has still been in data mode,
+        // otherwise the held lines have been the notification of the lost connection
+        async_delay_ms(EscapeGuardMs * 2);
+        if (rx.Available() > atDataTail)
+        {
+            await(PassDataTail, atDataTail);
+        }
+        else
+        {
+            MYDBG("Connection lost in data mode");
+            rx.Advance(atDataTail);
+            atDataTail = 0;
+            signals &= ~Signal::DataSuspect;
+            f.success = false;
+        }
+    }
+
+    f.success = f.success &&
+        await_mask_not_timeout(atResult, 0x80, 0x80, Timeout::Milliseconds(EscapeGuardMs * 2)) &&
+        atResult == ATResult::OK;
+
+    if (!f.success)
+    {
+        // the modem leaves the data mode by itself when the connection is lost,
+        // let the AT sequence be resynchronized
+        MYDBG("!! Failed to leave data mode");
+        ModemStatus(ModemStatus::CommandError);
+        if (dataSock)
+        {
+            dataSock->flags &= ~SocketFlags::ModemDataMode;
+            dataSock->Disconnected();
+            dataSock = NULL;
+        }
+    }
+
+    else
+    {
+        MYTRACE(TRACE_AT, "Command mode, %p waiting in data mode", dataSock);
+    }
+
+    ATUnlock();
+    async_return(f.success);
+}
+async_end
+
+async(Modem::PassDataTail, size_t len)
+async_def()
+{
+    // the receiver is waiting for the decision, so the data is passed to the socket here
+    if (dataSock)
+    {
+        await(rx.MoveTo, dataSock->InputWriter(), len);
+    }
+    else
+    {
+        rx.Advance(len);
+    }
+    atDataTail = 0;
+    signals &= ~Signal::DataSuspect;
+}
+async_end
+
+async(Modem::ATResumeData)
+async_def(
+    bool success;
+)
+{
+    MYDBG("Resuming data mode for socket %p", dataSock);
+    f.success = !(await(ATLock) ||
+        NextATCommand('O') ||
+        await(ATConnectData, *dataSock));
+    MYTRACE(TRACE_AT, "Data mode %s", f.success ? "resumed" : "not resumed");
+    async_return(f.success);
+}
+async_end
+
+size_t Modem::DataLostNotification(io::PipeReader& reader, size_t len)
+{
+    // SIM800 reports CLOSED, other modems NO CARRIER
+    static const char* const notifications[] = { "\r\nCLOSED\r\n", "\r\nNO CARRIER\r\n" };
+    for (auto n: notifications)
+    {
+        size_t nlen = strlen(n);
+        if (len < nlen)
+        {
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < nlen && reader.Peek(len - nlen + i) == n[i])
+        {
+            i++;
+        }
+        if (i == nlen)
+        {
+            return nlen;
+        }
+    }
+    return 0;
+}
+
+    RequestProcessing();
+}
+
+async(Modem::ATBatch, const Span* cmds, size_t count)
+async_def(
+    size_t i;
+    int res;
+)
+{
+    atBatchFailed = count;
+
+    if (await(ATLock))
+    {
+        async_return(int(ATResult::Failure));
+    }
+
+    for (f.i = 0; f.i < count; f.i++)
+    {
+        MYTRACE(TRACE_AT, ">> %s%b", f.i ? "  ;" : "AT", cmds[f.i]);
+    }
+
+    if (Buffer buf = DiagnosticBuffer(ModemOptions::CallbackType::CommandSend, DiagnosticLog::MaxRecord))
+    {
+        size_t len = 0;
+        for (size_t i = 0; i <= count; i++)
+        {
+            Span part = i ? cmds[i - 1] : Span("AT");
+            if (i > 1 && len < buf.Length())
+            {
+                buf.Pointer()[len++] = ';';
+            }
+            size_t n = std::min(part.Length(), buf.Length() - len);
+            memcpy(buf.Pointer() + len, part.Pointer(), n);
+            len += n;
+        }
+        DiagnosticCommit(ModemOptions::CallbackType::CommandSend, buf.Left(len));
+    }
+
+    ATStarted(cmds, count);
+    if (await(tx.Write, "AT") != 2)
+    {
+        async_return(ATWriteFailed());
+    }
+
+    for (f.i = 0; f.i < count; f.i++)
+    {
+        if ((f.i && await(tx.Write, ";") != 1) ||
+            await(tx.Write, cmds[f.i]) != (int)cmds[f.i].Length())
+        {
+            async_return(ATWriteFailed());
+        }
+    }
+
+    if (await(tx.Write, "\r") != 1)
+    {
+        async_return(ATWriteFailed());
+    }
+
+    f.res = await(ATResponse);
+    if (f.res == int(ATResult::Error))
+    {
+        // the modem stops executing the command line at the first failing command,
+        // but we cannot tell which one it was, so retry them one by one; the commands
+        // before it are repeated, which is why batches must consist of repeatable commands
+        // (this is also the fallback for modems that do not support concatenation)
+        MYDBG("AT batch failed, retrying %d commands separately", count);
+        for (f.i = 0; f.i < count; f.i++)
+        {
+            if ((f.res = await(AT, cmds[f.i])))
+            {
+                atBatchFailed = f.i;
+                break;
+            }
+        }
+    }
+
+    async_return(f.res);
+}
+async_end
+
+int Modem::ATWriteFailed()
+{
+    atResult = ATResult::Failure;
+    ATFinished();
+    ATUnlock();
+    ModemStatus(ModemStatus::CommandError);
+    return int(ATResult::Failure);
+}
+
+void Modem::ATStarted(const Span* cmds, size_t count)
+{
+#if GSM_AT_STATISTICS
+    // commands are identified by the part before arguments,
+    // so "+CIPSEND=0,10" and "+CIPSEND=1,20" share the same entry,
+    // as do the formatted commands with their format "+CIPSEND=%d,%d",
+    // the commands of a batch are executed and timed together
+    FNV1a hash;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i)
+        {
+            hash += ';';
+        }
+        for (char c: cmds[i])
+        {
+            if (c == '=' || c == '?' || c == '%')
+            {
+                break;
+            }
+            hash += c;
+        }
+    }
+    atStatsKey = hash;
+    atStart = MONO_CLOCKS;
+#endif
+}
+
+void Modem::ATFinished()
+{
+#if GSM_AT_STATISTICS
+    ATCommandStats* stats = NULL;
+    for (unsigned i = 0; i < atStatsUsed; i++)
+    {
+        if (atStats[i].command == atStatsKey)
+        {
+            stats = &atStats[i];
+            break;
+        }
+    }
+
+    if (!stats)
+    {
+        if (atStatsUsed < GSM_AT_STATISTICS - 1)
+        {
+            stats = &atStats[atStatsUsed++];
+            memset(stats, 0, sizeof(*stats));
+            stats->command = atStatsKey;
+        }
+        else
+        {
+            // the last entry collects all commands that did not fit
+            stats = &atStats[GSM_AT_STATISTICS - 1];
+            if (atStatsUsed < GSM_AT_STATISTICS)
+            {
+                atStatsUsed++;
+                memset(stats, 0, sizeof(*stats));
+            }
+        }
+    }
+
+    unsigned ms = (MONO_CLOCKS - atStart) / (MONO_FREQUENCY / 1000);
+    unsigned bucket = ms ? 32 - __builtin_clz(ms) : 0;
+    stats->histogram[std::min(bucket, unsigned(ATCommandStats::Buckets - 1))]++;
+
+    switch (atResult)
+    {
+        case ATResult::OK: stats->ok++; break;
+        case ATResult::Timeout: stats->timeout++; break;
+        default: stats->error++; break;
+    }
+#endif
+}
+
+size_t Modem::ATStatistics(ATCommandStats* stats, size_t count) const
+{
+#if GSM_AT_STATISTICS
+    count = std::min(count, size_t(atStatsUsed));
+    memcpy(stats, atStats, count * sizeof(ATCommandStats));
+    return count;
+#else
+    return 0;
+#endif
+}
+
+void Modem::ATUnlock()
+{
+    atNextTimeout = Timeout::Infinite;
+    atResponse = {};
+    atTask = NULL;
+    signals &= ~Signal::ATLock;
+}
+
+async(Modem::ATResponse)
+async_def(
+    Timeout timeout;
+)
+{
+    ASSERT(signals & Signal::ATLock);
+    ASSERT(atTask == &kernel::Task::Current());
+
+    f.timeout = (atNextTimeout || atTimeout).MakeAbsolute();
+    atNextTimeout = Timeout::Infinite;
+
+    if (!await_mask_not_timeout(atResult, 0x80, 0x80, f.timeout))
+    {
+        ModemStatus(ModemStatus::CommandError);
+        atResult = ATResult::Timeout;
+    }
+
+    ATFinished();
+    if (!(signals & Signal::DataMode))
+    {
+        ATUnlock();
+    }
+    async_return(int(atResult));
+}
+async_end
+
+void Modem::IndexFields(size_t start)
+{
+    lineFieldCount = 0;
+    lineIndexed = lineScan.valid && start <= lineScan.length;
+    if (!lineIndexed || start == lineScan.length)
+    {
+        return;
+    }
+
+    size_t pos = start;
+    auto add = [&](size_t end)
+    {
+        if (lineFieldCount < countof(lineFieldIndex))
+        {
+            lineFieldIndex[lineFieldCount] = { uint16_t(pos), uint16_t(end - pos) };
+        }
+        if (lineFieldCount < UINT8_MAX)
+        {
+            lineFieldCount++;
+        }
+        pos = end + 1;
+    };
+
+    if (!lineScan.quotes && lineScan.commas <= LineScan::MaxCommas)
+    {
+        // the field boundaries are already known from the line scan
+        for (unsigned i = 0; i < lineScan.commas; i++)
+        {
+            if (lineScan.comma[i] >= start)
+            {
+                add(lineScan.comma[i]);
+            }
+        }
+    }
+    else
+    {
+        // commas may be inside quoted strings
+        bool quoted = false;
+        for (size_t i = start; i < lineScan.length; i++)
+        {
+            if (lineData[i] == '"')
+            {
+                quoted = !quoted;
+            }
+            else if (lineData[i] == ',' && !quoted)
+            {
+                add(i);
+            }
+        }
+    }
+
+    add(lineScan.length);
+}
+
+Span Modem::InputFieldAt(unsigned index) const
+{
+    if (index >= lineFieldCount)
+    {
+        return Span();
+    }
+    if (index < countof(lineFieldIndex))
+    {
+        auto& fld = lineFieldIndex[index];
+        return Span(lineData + fld.offset, fld.length);
+    }
+
+    // beyond the index, continue from the end of the last indexed field
+    auto& last = lineFieldIndex[countof(lineFieldIndex) - 1];
+    size_t pos = last.offset + last.length + 1;
+    unsigned n = countof(lineFieldIndex);
+    bool quoted = false;
+    for (size_t i = pos; i <= lineScan.length; i++)
+    {
+        if (i == lineScan.length || (lineData[i] == ',' && !quoted))
+        {
+            if (n++ == index)
+            {
+                return Span(lineData + pos, i - pos);
+            }
+            pos = i + 1;
+        }
+        else if (lineData[i] == '"')
+        {
+            quoted = !quoted;
+        }
+    }
+    return Span();
+}
+
+bool Modem::SeekField(unsigned index, io::Pipe::Iterator& iter) const
+{
+    bool quoted = false;
+    while (index)
+    {
+        if (!iter)
+        {
+            return false;
+        }
+        char c = *iter;
+        ++iter;
+        if (c == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (c == ',' && !quoted)
+        {
+            index--;
+        }
+    }
+    return true;
+}
+
+Span Modem::InputFieldStringAt(unsigned index) const
+{
+    Span fld = InputFieldAt(index);
+    auto p = (const char*)fld.Pointer();
+    if (fld.Length() >= 2 && p[0] == '"' && p[fld.Length() - 1] == '"')
+    {
+        return Span(p + 1, fld.Length() - 2);
+    }
+    return fld;
+}
+
+bool Modem::InputFieldNumAt(unsigned index, int& res, unsigned base) const
+{
+    Span fld = InputFieldStringAt(index);
+    char copy[16];
+    if (!lineIndexed)
+    {
+        // the line is not in contiguous memory, work with a copy of the field
+        auto iter = lineFieldStart;
+        size_t len = 0;
+        if (!SeekField(index, iter))
+        {
+            return false;
+        }
+        for (; iter && *iter != ','; ++iter)
+        {
+            if (len == sizeof(copy))
+            {
+                // too long for any number
+                return false;
+            }
+            copy[len++] = *iter;
+        }
+        fld = Span(copy, len);
+        if (len >= 2 && copy[0] == '"' && copy[len - 1] == '"')
+        {
+            fld = Span(copy + 1, len - 2);
+        }
+    }
+
+    auto p = (const char*)fld.Pointer();
+    auto e = p + fld.Length();
+
+    res = 0;
+    bool neg = false;
+    if (p < e && (*p == '+' || (neg = *p == '-')))
+        p++;
+
+    if (p == e)
+        return false;
+
+    for (; p < e; p++)
+    {
+        char c = *p;
+        size_t digit;
+
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'z')
+            digit = c + 10 - 'a';
+        else if (c >= 'A' && c <= 'Z')
+            digit = c + 10 - 'A';
+        else
+            return false;
+
+        if (digit >= base)
+            return false;
+
+        res = res * base + digit;
+    }
+
+    if (neg)
+    {
+        res = -res;
+    }
+    return true;
+}
+
+uint32_t Modem::InputFieldFnvAt(unsigned index) const
+{
+    FNV1a fnv;
+    if (!lineIndexed)
+    {
+        // the line is not in contiguous memory, hash the field directly from the pipe
+        auto iter = lineFieldStart;
+        if (SeekField(index, iter))
+        {
+            bool quoted = false;
+            for (; iter && (quoted || *iter != ','); ++iter)
+            {
+                quoted ^= *iter == '"';
+                fnv += *iter;
+            }
+        }
+        return fnv;
+    }
+
+    Span fld = InputFieldAt(index);
+    auto p = (const char*)fld.Pointer();
+    for (size_t i = 0; i < fld.Length(); i++)
+    {
+        fnv += p[i];
+    }
+    return fnv;
+}
+
+unsigned Modem::InputFieldCount() const
+{
+    if (lineIndexed)
+    {
+        return lineFieldCount;
+    }
+
+    // the line is not in contiguous memory, count the same way directly from the pipe
+    unsigned n = 0;
+    bool empty = true;
+    bool quoted = false;
+
+    for (char c: lineFieldStart)
+    {
+        empty = false;
+        quoted ^= c == '"';
+        if (c == ',' && !quoted && n < UINT8_MAX)
+        {
+            n++;
+        }
+    }
+
+    if (!empty && n < UINT8_MAX)
+        n++;
+
+    return n;
+}
+
+bool Modem::InputFieldNum(int& res, unsigned base)
+{
+    res = 0;
+    auto iter = lineFields;
+
+    bool neg = false;
+
+    if (iter && (*iter == '+' || (neg = *iter == '-')))
+        ++iter;
+
+    bool hasDigit = false;
+    bool error = false;
+    while (iter)
+    {
+        char c = *iter;
+        size_t digit;
+
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'z')
+            digit = c + 10 - 'a';
+        else if (c >= 'A' && c <= 'Z')
+            digit = c + 10 - 'A';
+        else
+            break;
 
         if (digit >= base)
         {
@@ -854,6 +2277,53 @@ bool Modem::InputFieldFnv(uint32_t& res)
     return true;
 }
 
+void Modem::RegisterURC(URCHandler& handler)
+{
+    ASSERT(!urcHandlers.Contains(&handler));
+    urcHandlers.Append(&handler);
+    urcFilter |= uint64_t(1) << (handler.hash & 63);
+}
+
+void Modem::UnregisterURC(URCHandler& handler)
+{
+    urcFilter = 0;
+    for (auto& manip: urcHandlers.Manipulate())
+    {
+        if (&manip.Element() == &handler)
+        {
+            manip.Remove();
+        }
+        else
+        {
+            urcFilter |= uint64_t(1) << (manip.Element().hash & 63);
+        }
+    }
+}
+
+async(Modem::DispatchURC, FNV1a hash)
+async_def(
+    URCHandler* h;
+)
+{
+    if (!(urcFilter & (uint64_t(1) << (uint32_t(hash) & 63))))
+    {
+        // fast rejection of unknown events
+        async_return(false);
+    }
+
+    for (f.h = urcHandlers.First(); f.h; f.h = f.h->next)
+    {
+        if (f.h->hash == uint32_t(hash))
+        {
+            await(f.h->handler, hash);
+            async_return(true);
+        }
+    }
+
+    async_return(false);
+}
+async_end
+
 async(Modem::NetworkActive, Timeout timeout)
 async_def()
 {
@@ -869,9 +2339,41 @@ async_end
 
 void Modem::PowerDiagnostic(ModemOptions::CallbackType type, Span msg)
 {
-    if (Buffer buf = options.GetDiagnosticBuffer(type))
+    if (Buffer buf = DiagnosticBuffer(type, msg.Length()))
+    {
+        DiagnosticCommit(type, msg.CopyTo(buf));
+    }
+}
+
+Buffer Modem::DiagnosticBuffer(ModemOptions::CallbackType type, size_t length)
+{
+    if (diagLog.Active())
+    {
+        // the data is stored directly in the capture log
+        return diagLog.Reserve(length);
+    }
+    return options.GetDiagnosticBuffer(type);
+}
+
+void Modem::DiagnosticCommit(ModemOptions::CallbackType type, Buffer data)
+{
+    if (diagLog.Active())
+    {
+        diagLog.Commit(type, data.Length());
+    }
+    else
+    {
+        options.DiagnosticCallback(type, data);
+    }
+}
+
+void Modem::ReplayDiagnostics()
+{
+    DiagnosticLog::Record rec;
+    while (diagLog.Peek(rec))
     {
-        options.DiagnosticCallback(type, msg.CopyTo(buf));
+        options.DiagnosticCallback(rec.type, (char*)rec.data.Pointer(), rec.data.Length());
+        diagLog.Pop();
     }
 }
 
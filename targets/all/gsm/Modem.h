@@ -18,6 +18,21 @@
 #include "Socket.h"
 #include "Message.h"
 #include "ModemOptions.h"
+#include "ATCommand.h"
+#include "DiagnosticLog.h"
+#include "LineScan.h"
+#include "ObjectPool.h"
+#include "DnsCache.h"
+
+//! Number of distinct AT commands for which latency statistics are collected, zero to disable
+#ifndef GSM_AT_STATISTICS
+#define GSM_AT_STATISTICS   16
+#endif
+
+//! Combined length of the recipient and text stored in a pooled message, longer messages are allocated from the heap
+#ifndef GSM_POOL_MESSAGE_LENGTH
+#define GSM_POOL_MESSAGE_LENGTH 192
+#endif
 
 namespace gsm
 {
@@ -76,12 +91,50 @@ public:
     unsigned MncDigits() const { return mncDigits; }
 };
 
+//! Execution statistics of a single AT command
+struct ATCommandStats
+{
+    enum
+    {
+        //! Bucket 0 counts commands completed in less than 1 ms,
+        //! bucket N counts commands completed in [2^(N-1), 2^N) ms,
+        //! the last bucket includes all longer durations
+        Buckets = 18,
+    };
+
+    //! FNV1a hash of the command prefix up to the first '=', '?' or formatting directive, e.g. fnv1a("+CIPSEND"),
+    //! a batch is identified by the prefixes of all its commands, e.g. fnv1a("+CSQ;+CREG"),
+    //! zero for commands that did not fit in the statistics table
+    uint32_t command;
+    uint32_t ok, error, timeout;
+    uint32_t histogram[Buckets];
+
+    uint32_t Count() const { return ok + error + timeout; }
+};
+
+//! Handler for unsolicited result codes, registered at runtime using Modem::RegisterURC
+class URCHandler
+{
+public:
+    //! Creates a handler for events with the specified header hash, e.g. fnv1a("+CMTI")
+    URCHandler(uint32_t hash, AsyncDelegate<FNV1a> handler)
+        : hash(hash), handler(handler) {}
+
+private:
+    URCHandler* next = NULL;
+    uint32_t hash;
+    AsyncDelegate<FNV1a> handler;
+
+    friend class Modem;
+    friend class SelfLinkedList<URCHandler>;
+};
+
 class Modem
 {
 public:
 
     Modem(io::DuplexPipe pipe, ModemOptions& options)
-        : rx(pipe), tx(pipe), options(options) {}
+        : rx(pipe), tx(pipe), options(options), atSwitchTo(pipe) {}
 
     enum ModemStatus ModemStatus() const { return modemStatus; }
     enum GsmStatus GsmStatus() const { return gsmStatus; }
@@ -96,6 +149,8 @@ public:
 
     bool IsActive() const { return !!(signals & Signal::TaskActive); }
     bool IsDisconnecting() const { return !!(signals & Signal::NetworkDisconnecting); }
+    //! Checks if the modem is in transparent data mode
+    bool IsDataMode() const { return !!(signals & Signal::DataMode); }
 
     int Rssi() const { return rssi; }
 
@@ -111,8 +166,61 @@ public:
     async(WaitForIdle, Timeout timeout);
     async(WaitForPowerOn, Timeout timeout);
     async(WaitForPowerOff, Timeout timeout);
-    Socket* CreateSocket(Span host, uint32_t port, bool tls);
-    Message* SendMessage(Span recipient, Span text);
+    //! Creates a socket connecting to the specified host
+    //! @returns NULL if the socket cannot be allocated, or if TLS is requested for a datagram socket
+    Socket* CreateSocket(Span host, uint32_t port, bool tls, const SocketOptions& opts = SocketOptions());
+    Message* SendMessage(Span recipient, Span text, const SendPolicy& policy = SendPolicy());
+
+    //! Registers an additional handler for unsolicited result codes,
+    //! which is called for events not handled by the driver itself
+    void RegisterURC(URCHandler& handler);
+    //! Removes a handler previously registered using RegisterURC
+    void UnregisterURC(URCHandler& handler);
+
+    //! Input line accessors, can be used by URC handlers
+    io::PipeReader Input() { return rx; }
+    size_t InputLength() const { return rx.LengthUntil(lineEnd); }
+    io::Pipe::Iterator& InputField() { return lineFields; }
+    //! Gets the total number of fields in the current line, regardless of the fields already read
+    //! using the sequential accessors; commas within quotes do not separate fields and an empty line has none
+    unsigned InputFieldCount() const;
+    bool InputFieldNum(int& n, unsigned base = 10);
+    bool InputFieldHex(int& n) { return InputFieldNum(n, 16); }
+    bool InputFieldFnv(uint32_t& fnv);
+
+    //! Random access to the fields of the current line, independent of the sequential
+    //! accessors above; numeric fields may be enclosed in quotes
+    //! The spans are available only if InputFieldsIndexed, otherwise the line is too long
+    //! to be kept in contiguous memory and they are empty; the numbers and hashes work on any line
+    bool InputFieldsIndexed() const { return lineIndexed; }
+    Span InputFieldAt(unsigned index) const;
+    Span InputFieldStringAt(unsigned index) const;
+    bool InputFieldNumAt(unsigned index, int& n, unsigned base = 10) const;
+    bool InputFieldHexAt(unsigned index, int& n) const { return InputFieldNumAt(index, n, 16); }
+    uint32_t InputFieldFnvAt(unsigned index) const;
+
+    //! Captures diagnostic records into a ring buffer in the provided storage
+    //! instead of passing each of them to ModemOptions::DiagnosticCallback immediately,
+    //! an empty buffer returns to the immediate callbacks
+    void CaptureDiagnostics(Buffer storage) { diagLog.Init(storage); }
+    //! Formats the captured diagnostic records as text lines, removing them from the log
+    //! @returns the number of bytes written to the buffer
+    size_t DrainDiagnostics(Buffer out) { return diagLog.Format(out); }
+    //! Passes the captured diagnostic records to ModemOptions::DiagnosticCallback, removing them from the log
+    void ReplayDiagnostics();
+    //! Direct access to the diagnostic capture log
+    DiagnosticLog& Diagnostics() { return diagLog; }
+
+    //! Usage statistics of the socket pool
+    const PoolStats& SocketPoolStats() const { return socketPool.Stats(); }
+    //! Usage statistics of the message pool
+    const PoolStats& MessagePoolStats() const { return messagePool.Stats(); }
+
+    //! Copies the collected AT command statistics to the provided array
+    //! @returns the number of entries copied
+    size_t ATStatistics(ATCommandStats* stats, size_t count) const;
+    //! Clears all collected AT command statistics
+    void ResetATStatistics() { atStatsUsed = 0; }
 
 protected:
     enum struct ATResult : int8_t
@@ -132,9 +240,11 @@ protected:
     //! Sets a callback for the next AT call, can be called only after ATLock
     //! @returns false so it can be easily chained between ATLock and ATXxx
     bool NextATResponse(AsyncDelegate<FNV1a> handler, uint8_t mask = 1) { ASSERT(atTask == &kernel::Task::Current()); atResponse = handler; atRequire = mask; return false; }
-    //! Sets the socket from which data will be transmitted during the AT command
+    //! Sets the socket from which data will be transmitted during the AT command;
+    //! with complete set, the command completes as soon as the data is transmitted, so that
+    //! further commands can be sent before the modem confirms the data
     //! @returns false so it can be easily chained between ATLock and ATXxx
-    bool NextATTransmit(Socket& sock, size_t len) { ASSERT(atTask == &kernel::Task::Current()); atTransmitSock = &sock; atTransmitLen = len; return false; }
+    bool NextATTransmit(Socket& sock, size_t len, size_t offset = 0, bool complete = false) { ASSERT(atTask == &kernel::Task::Current()); atTransmitSock = &sock; atTransmitLen = len; atTransmitOffset = offset; atTransmitComplete = complete; return false; }
     //! Sets the message which will be transmitted during the AT command
     //! @returns false so it can be easily chained between ATLock and ATXxx
     bool NextATTransmit(Message& msg) { ASSERT(atTask == &kernel::Task::Current()); atTransmitMsg = &msg; return false; }
@@ -155,6 +265,39 @@ protected:
     //! Executes a simple AT command
     //! @returns an ATResult indicating the result of the command execution
     async(ATFormatV, const char* format, va_list va);
+    //! Prepares the command for the next ATExecute, can be called only after ATLock
+    //! @returns false so it can be easily chained between ATLock and ATExecute
+    template<typename... Args> bool NextATCommand(const Args&... args) { ASSERT(atTask == &kernel::Task::Current()); atCommand.Format(args...); return false; }
+    //! Executes the AT command prepared using NextATCommand
+    //! @returns an ATResult indicating the result of the command execution
+    async(ATExecute);
+    //! Executes several AT commands joined into a single command line (AT<cmd1>;<cmd2>;...)
+    //! as one transaction; all commands must use the extended (+XXX) syntax.
+    //! After an ERROR all commands are executed again one by one, as the response does not tell
+    //! how many of them have already taken effect, so a batch may only contain commands that can
+    //! be safely repeated (settings and queries, not actions like connecting or sending)
+    //! @returns an ATResult indicating the result of the command execution,
+    //! use ATBatchFailed to find out which of the commands has failed
+    async(ATBatch, const Span* cmds, size_t count);
+    //! Executes the command prepared using NextATCommand, which switches the modem to transparent
+    //! data mode for the specified socket on success (e.g. ATO or CIPSTART in transparent mode);
+    //! the command is complete when the CONNECT response arrives, optionally preceded by OK.
+    //! The lock is kept by the calling task while in data mode and it is released automatically
+    //! when the modem returns to command mode before another AT command is executed.
+    //! @returns an ATResult indicating the result of the command execution
+    async(ATConnectData, Socket& sock);
+    //! Executes the command prepared using NextATCommand, which changes the framing of the link
+    //! to the modem (e.g. AT+CMUX); the AT engine continues on the specified pipe right after the OK response
+    //! @returns an ATResult indicating the result of the command execution
+    async(ATSwitchPipe, io::DuplexPipe pipe);
+    //! Gets the length of the connection loss notification at the end of the data received in data mode
+    //! @returns zero if the data does not end with one
+    static size_t DataLostNotification(io::PipeReader& reader, size_t len);
+    //! Replaces the pipe used to communicate with the modem, can be called only when the modem task is not running
+    void UsePipe(io::DuplexPipe pipe) { ASSERT(!(signals & (Signal::TaskActive | Signal::RxTaskActive))); rx = io::PipeReader(pipe); tx = io::PipeWriter(pipe); }
+    //! Gets the index of the command that failed in the last ATBatch
+    //! @returns the number of commands in the batch if no specific command failed
+    size_t ATBatchFailed() const { return atBatchFailed; }
 
     void ReceiveForSocket(Socket* sock, size_t len) { rxSock = sock; rxLen = len; }
 
@@ -162,12 +305,20 @@ protected:
 
     virtual size_t SocketSizeImpl() const { return sizeof(Socket); }
     virtual size_t MessageSizeImpl() const { return sizeof(Message); }
+    //! Number of sockets the modem can have open at the same time, used to size the socket pool
+    //! unless ModemOptions::SocketPoolCapacity is set; zero if not known yet (e.g. before the model is detected)
+    virtual size_t SocketCapacityImpl() const { return 4; }
     virtual bool TryAllocateImpl(Socket& sock) = 0;
+    //! Called before a socket is destroyed to release any resources allocated by TryAllocateImpl
+    virtual void FreeImpl(Socket& sock) {}
     virtual async(ConnectImpl, Socket& sock) = 0;
     virtual async(SendPacketImpl, Socket& sock) = 0;
     virtual async(ReceivePacketImpl, Socket& sock) = 0;
     virtual async(CheckIncomingImpl, Socket& sock) = 0;
     virtual async(CloseImpl, Socket& sock) = 0;
+    //! Resolves the host name using the modem, passing the result to DnsResolved
+    //! @returns true if the name has been resolved
+    virtual async(ResolveImpl, Span host) async_def_return(false);
 
     virtual async(SendMessageImpl, Message& msg) async_def_return(false);
 
@@ -188,28 +339,40 @@ protected:
     void NetworkInfo(const class NetworkInfo& info) { netInfo = info; }
     void Rssi(int8_t value) { rssi = value; }
 
+    //! Records the address the host name resolved to, see ModemOptions::DnsCacheSeconds
+    void DnsResolved(Span host, Span address) { dns.Store(host, address, options.DnsCacheSeconds(), MONO_CLOCKS); }
+    //! Forgets the cached address of the socket host after connecting to it failed
+    void DnsFailed(Socket& sock) { dns.Invalidate(sock.host); }
+    //! Gets the host the socket should connect to, which is the cached address of the host name if available
+    const char* ConnectHost(Socket& sock);
+    //! Checks if the host is an IPv4 or IPv6 address literal
+    static bool IsAddressLiteral(const char* host);
+
     void RequestProcessing() { process = true; }
 
-    io::PipeReader Input() { return rx; }
-    size_t InputLength() const { return rx.LengthUntil(lineEnd); }
     io::PipeWriter Output() { return tx; }
     ModemOptions& Options() { return options; }
     SelfLinkedList<Socket>& Sockets() { return sockets; }
 
-    io::Pipe::Iterator& InputField() { return lineFields; }
-    unsigned InputFieldCount() const;
-    bool InputFieldNum(int& n, unsigned base = 10);
-    bool InputFieldHex(int& n) { return InputFieldNum(n, 16); }
-    bool InputFieldFnv(uint32_t& fnv);
-
     void PowerDiagnostic(ModemOptions::CallbackType type, Span msg);
+    Buffer DiagnosticBuffer(ModemOptions::CallbackType type, size_t length);
+    void DiagnosticCommit(ModemOptions::CallbackType type, Buffer data);
 
 private:
     io::PipeReader rx;
     io::PipeWriter tx;
     ModemOptions& options;
     SelfLinkedList<Socket> sockets;
+    Socket* scheduledFirst = NULL;
+    Socket* scheduledLast = NULL;
+    //! Socket output and messages waiting for transmission, the only ones the send scheduling looks at
+    SendState* waitingFirst = NULL;
+    SendState* waitingLast = NULL;
     SelfLinkedList<Message> messages;
+    ObjectPool socketPool, messagePool;
+    SelfLinkedList<URCHandler> urcHandlers;
+    uint64_t urcFilter = 0;
+    DiagnosticLog diagLog;
 
     enum struct Signal
     {
@@ -220,22 +383,64 @@ private:
         NetworkDisconnecting = BIT(3),
         ATLock = BIT(4),
         RequireActive = BIT(5), // set if there are active sockets or messsages
+        Resync = BIT(6),        // AT command sequence is being resynchronized
+        DataMode = BIT(7),      // modem is in transparent data mode, the ATLock is held by the task that entered it
+        ATWanted = BIT(8),      // a task is waiting for the ATLock
+        DataSuspect = BIT(9),   // the data received in data mode ends with what may be a notification of the lost connection
     } signals = Signal::None;
 
     DECLARE_FLAG_ENUM(Signal);
 
     bool process = false;
+    //! Time until the held output or a parked socket needs attention, zero if nothing is waiting
+    mono_t coalesceWait = 0;
+    DnsCache dns;
+
+    enum
+    {
+        //! Credit in bytes added to each output queue in a round of the deficit round robin, multiplied by its weight
+        SendQuantum = 256,
+        //! Maximum number of packets and messages sent in a single pass of the task
+        SendBurst = 8,
+    };
     ATResult atResult = ATResult::OK;
     uint8_t atComplete, atRequire;
 
     io::PipePosition lineEnd;
-    io::Pipe::Iterator lineFields;
+    io::Pipe::Iterator lineFields, lineFieldStart;
+    LineScan lineScan;
+    const char* lineData;
+    char lineCopy[128];
+    bool lineIndexed = false;
+    //! Total number of fields, only the first ones are kept in the index
+    uint8_t lineFieldCount = 0;
+    struct { uint16_t offset, length; } lineFieldIndex[16];
     kernel::Task* atTask = NULL;
     Timeout atNextTimeout;
     AsyncDelegate<FNV1a> atResponse;
     Socket* atTransmitSock;
     Message* atTransmitMsg;
-    size_t atTransmitLen;
+    size_t atTransmitLen, atTransmitOffset;
+    bool atTransmitComplete = false;
+    size_t atBatchFailed = 0;
+    ATCommand atCommand;
+    uint8_t atResyncSeq = 0;
+    bool atResyncEcho = false;
+    bool atExpectConnect = false;
+    //! Length of the possible notification of the lost connection held back at the end of the data,
+    //! until the escape from the data mode tells if the modem is still in data mode
+    size_t atDataTail = 0;
+    Socket* dataSock = NULL;
+    //! Pipe the AT engine continues on after the OK response to ATSwitchPipe
+    io::DuplexPipe atSwitchTo;
+    bool atSwitch = false;
+    uint8_t rxLines = 0;
+#if GSM_AT_STATISTICS
+    ATCommandStats atStats[GSM_AT_STATISTICS];
+    uint32_t atStatsKey;
+    mono_t atStart;
+#endif
+    uint8_t atStatsUsed = 0;
     Socket* rxSock;
     size_t rxLen = 0;
 
@@ -251,12 +456,62 @@ private:
     Timeout disconnectTimeout = Timeout::Seconds(10);
     Timeout powerOffTimeout = Timeout::Infinite;
 
+    enum
+    {
+        //! Silence required before and after the +++ escape sequence
+        EscapeGuardMs = 1100,
+    };
+
     async(Task);
+    async(WaitProcessing);
     async(RxTask);
     async(ATResponse);
+    async(ATResync);
+    async(RxWaitQuiet);
+    //! Returns the modem from data mode to command mode and releases the lock kept for the data mode
+    //! @returns true if the modem is in command mode
+    async(ATEscapeData);
+    //! Returns the modem to data mode for dataSock
+    //! @returns true if the data mode has been resumed
+    async(ATResumeData);
+    //! Passes the data held back by the receiver in data mode to the socket, along with the suspected notification
+    //! of the lost connection at its end, and lets the receiver continue
+    async(PassDataTail, size_t len);
+    //! Checks if there are tasks waiting for the ATLock
+    bool ATWaiting() const { return !!(signals & Signal::ATWanted); }
+    async(DispatchURC, FNV1a hash);
+    int ATWriteFailed();
+    void ATStarted(const Span* cmds, size_t count = 1);
+    void ATFinished();
+    void ATUnlock();
+    void IndexFields(size_t start);
+    //! Moves the iterator from the first field of the current line to the specified field
+    //! @returns false if the line has fewer fields
+    bool SeekField(unsigned index, io::Pipe::Iterator& iter) const;
 
     void ReleaseSocket(Socket* sock);
+    //! Hands a parked connection to the specified endpoint over to a new socket
+    //! @returns NULL if there is no such connection
+    Socket* AdoptSocket(Span host, uint16_t port, bool tls, const SocketOptions& opts);
+    //! Closes the parked connection that has been idle for the longest time, to free its channel for another socket
+    //! @returns false if there is no parked connection
+    bool CloseOldestParked();
+    //! Checks if the host name of the socket should be resolved before connecting
+    bool NeedsResolve(Socket& sock);
     void DestroySocket(Socket* sock);
+    //! Appends the socket to the queue of sockets processed in the next pass of the modem task
+    void ScheduleSocket(Socket* sock, bool wake = true);
+    void UnscheduleSocket(Socket* sock);
+    Socket* NextScheduledSocket();
+    //! Appends the socket output or message to the list of waiting output
+    void ListWaiting(SendState& st, Socket* sock, Message* msg);
+    void UnlistWaiting(SendState& st);
+    //! Lists the sockets that have got output to send since the last check
+    void ListNewOutput();
+    //! Picks the socket or message to be transmitted next from the list of waiting output
+    //! @returns false if there is nothing to send
+    bool PickNextSend(Socket*& sock, Message*& msg);
+    template<typename F> void ForEachPendingSend(F fn);
 
     void ReleaseMessage(Message* msg);
     void DestroyMessage(Message* msg);
@@ -25,6 +25,29 @@ public:
     virtual void OnPowerOff() { }
     virtual bool RemovePin() { return true; }
     virtual bool UseFlowControl() { return true; }
+    //! Configures the modem for a single socket connected in transparent mode,
+    //! without the per-packet AT command overhead
+    virtual bool UseTransparentMode() { return false; }
+    //! Runs the AT engine over a 27.010 multiplexer channel (AT+CMUX); the connection
+    //! in transparent mode gets a channel of its own, so the AT commands do not interrupt it,
+    //! the remaining channel is available as an additional serial link
+    virtual bool UseMultiplexer() { return false; }
+    //! Time in milliseconds a released, still connected socket is kept open,
+    //! so that a new socket to the same endpoint can take over the connection; zero disables reuse
+    virtual unsigned SocketReuseMs() { return 0; }
+    //! Time in seconds the address a host name resolved to is used for new plain connections,
+    //! zero lets the modem resolve the name on every connect
+    virtual unsigned DnsCacheSeconds() { return 0; }
+    //! Leaves the received TLS data buffered in the modem until the socket has room for it,
+    //! instead of having the modem push it as soon as it arrives (SIM7600); the room is given only by
+    //! SocketOptions::inputLimit, the input pipes grow as needed, so sockets without the limit
+    //! keep pulling the data as fast as the modem provides it
+    virtual bool UseBufferedTlsReceive() { return false; }
+    //! Number of messages that can be queued for sending without allocating from the heap
+    virtual size_t MessageOutboxDepth() { return 2; }
+    //! Number of sockets that can be open without allocating from the heap, zero to use the channel count
+    //! of the detected modem; sockets created before the detection are allocated from the heap then
+    virtual size_t SocketPoolCapacity() { return 0; }
 
     enum struct CallbackType
     {
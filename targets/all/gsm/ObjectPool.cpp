@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/ObjectPool.cpp
+ */
+
+#include "ObjectPool.h"
+
+namespace gsm
+{
+
+void ObjectPool::Configure(size_t blockSize, size_t capacity)
+{
+    ASSERT(!slab);
+    stats.blockSize = (std::max(blockSize, sizeof(FreeBlock)) + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    stats.capacity = capacity;
+}
+
+void* ObjectPool::Allocate(size_t size)
+{
+    if (!slab && stats.capacity && (slab = (char*)malloc(stats.blockSize * stats.capacity)))
+    {
+        // build the free list
+        for (size_t i = stats.capacity; i--; )
+        {
+            auto block = (FreeBlock*)(slab + i * stats.blockSize);
+            block->next = freeList;
+            freeList = block;
+        }
+    }
+
+    if (size > stats.blockSize || !freeList)
+    {
+        stats.fallbacks++;
+        return malloc(size);
+    }
+
+    auto block = freeList;
+    freeList = block->next;
+    stats.allocations++;
+    if (++stats.used > stats.peak)
+    {
+        stats.peak = stats.used;
+    }
+    return block;
+}
+
+void ObjectPool::Free(void* block)
+{
+    if (!Contains(block))
+    {
+        free(block);
+        return;
+    }
+
+    ASSERT(stats.used);
+    auto fb = (FreeBlock*)block;
+    fb->next = freeList;
+    freeList = fb;
+    stats.used--;
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/ObjectPool.h
+ *
+ * Fixed-capacity pool of equally sized memory blocks
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+namespace gsm
+{
+
+//! Usage statistics of an ObjectPool
+struct PoolStats
+{
+    //! Size of a single block in bytes
+    uint16_t blockSize;
+    //! Number of blocks in the pool
+    uint16_t capacity;
+    //! Number of blocks currently in use
+    uint16_t used;
+    //! Largest number of blocks used at the same time
+    uint16_t peak;
+    //! Total number of allocations served from the pool
+    uint32_t allocations;
+    //! Number of allocations that did not fit in the pool and were passed to malloc
+    uint32_t fallbacks;
+};
+
+//! Pool of equally sized blocks carved from a single heap allocation
+//!
+//! The slab is allocated on first use and kept for the lifetime of the pool,
+//! so objects that are created and destroyed repeatedly do not fragment the heap.
+//! Requests larger than the block size or exceeding the capacity are passed
+//! to malloc and counted as fallbacks.
+class ObjectPool
+{
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool& other) = delete;
+    ~ObjectPool() { free(slab); }
+
+    //! Sets the dimensions of the pool, must be called before the first allocation
+    void Configure(size_t blockSize, size_t capacity);
+    bool IsConfigured() const { return stats.blockSize; }
+
+    void* Allocate(size_t size);
+    void Free(void* block);
+
+    const PoolStats& Stats() const { return stats; }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    char* slab = NULL;
+    FreeBlock* freeList = NULL;
+    PoolStats stats = {};
+
+    bool Contains(void* block) const { return slab && (char*)block >= slab && (char*)block < slab + stats.blockSize * stats.capacity; }
+};
+
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/SendPolicy.h
+ *
+ * Scheduling of socket output and messages
+ */
+
+#pragma once
+
+#include <kernel/kernel.h>
+
+namespace gsm
+{
+
+//! Priority class of socket output or a message
+enum struct SendClass : uint8_t
+{
+    //! Alarms and other traffic requiring the lowest latency
+    Urgent,
+    //! Regular traffic
+    Normal,
+    //! Large transfers that should not delay the other classes
+    Bulk,
+
+    Count,
+};
+
+//! Scheduling parameters of socket output or a message
+//!
+//! The modem serves the classes in priority order, unless the deadline
+//! of pending output is about to expire (less than a quarter of it remains),
+//! then the class with the earliest such deadline is served first.
+//! Output of the same class is interleaved using deficit round robin,
+//! each round credits every queue with the weight multiple of a fixed quantum.
+struct SendPolicy
+{
+    SendClass priority = SendClass::Normal;
+    //! Relative share of the transmissions within the class
+    uint8_t weight = 1;
+    //! Maximum time in milliseconds pending data should wait for transmission, zero for no deadline
+    uint16_t deadlineMs = 0;
+};
+
+//! Scheduling state of a socket output or a message, maintained by the modem
+struct SendState
+{
+    SendPolicy policy;
+    //! Set while there is data waiting for transmission
+    bool waiting = false;
+    //! Size of the next transmission, zero if the output is not eligible for sending
+    uint16_t cost = 0;
+    //! Credit accumulated in the round robin
+    int32_t deficit = 0;
+    //! Time when the waiting data was first noticed, or of the last transmission if some data remained
+    mono_t since = 0;
+    //! Socket or message the output belongs to, set when it is added to the list of waiting output
+    class Socket* socket = NULL;
+    class Message* message = NULL;
+    //! Next entry of the list of waiting output kept by the modem
+    SendState* nextWaiting = NULL;
+    //! Set while the output is in the list of waiting output
+    bool listed = false;
+
+    //! Updates the state with the size of the next transmission, zero if there is nothing to send
+    void Update(size_t pending, mono_t now)
+    {
+        if (!pending)
+        {
+            waiting = false;
+            cost = 0;
+            deficit = 0;
+            return;
+        }
+
+        if (!waiting)
+        {
+            waiting = true;
+            since = now;
+        }
+        cost = std::min(pending, size_t(UINT16_MAX));
+    }
+
+    //! Keeps the data waiting, but not eligible for sending
+    void Hold() { cost = 0; }
+    //! Records the transmission, the data left waiting gets a new deadline
+    void Sent(mono_t now) { since = now; }
+
+    bool Pending() const { return waiting && cost; }
+    bool HasDeadline() const { return waiting && policy.deadlineMs; }
+    mono_t Deadline() const { return since + policy.deadlineMs * (MONO_FREQUENCY / 1000); }
+    //! Checks if the deadline is about to expire, so it takes precedence over the priority
+    bool DeadlineDue(mono_t now) const
+    {
+        mono_t limit = policy.deadlineMs * (MONO_FREQUENCY / 1000);
+        return HasDeadline() && now - since >= limit - limit / 4;
+    }
+};
+
+}
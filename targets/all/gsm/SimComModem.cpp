@@ -23,54 +23,66 @@ namespace gsm
 
 bool SimComModem::TryAllocateImpl(Socket& sock)
 {
+    unsigned count;
     switch (model)
     {
         case Model::SIM800:
-        {
-            // allocate any of the 6 sockets
-            uint32_t avail = MASK(6);
-            for (auto& other: Sockets())
-            {
-                if (other.IsAllocated())
-                    RESBIT(avail, S(other).channel);
-            }
-            if (avail)
-            {
-                S(sock).channel = __builtin_ctz(avail);
-                sock.Allocate();
-                MYDBG("%s channel %d bound to socket %p", "TLS/TCP", S(sock).channel, &sock);
-                return true;
-            }
+            // any of the 6 sockets, TLS is configured per channel
+            count = transparent ? 1 : 6;
             break;
-        }
 
         case Model::SIM7600:
-        {
             // there are two TLS and 10 regular sockets
-            uint32_t avail = MASK(sock.IsSecure() ? 2 : 10);
-            for (auto& other: Sockets())
-            {
-                if (other.IsSecure() == sock.IsSecure() && other.IsAllocated())
-                    RESBIT(avail, S(other).channel);
-            }
-            if (avail)
-            {
-                S(sock).channel = __builtin_ctz(avail);
-                sock.Allocate();
-                MYDBG("%s channel %d bound to socket %p", sock.IsSecure() ? "TLS" : "TCP", S(sock).channel, &sock);
-                return true;
-            }
+            count = sock.IsSecure() ? 2 : 10;
             break;
-        }
 
         default:
             MYDBG("Unsupported modem");
-            break;
+            return false;
+    }
+
+    if (transparent)
+    {
+        if (sock.IsDatagram() || (sock.IsSecure() && model != Model::SIM800))
+        {
+            MYDBG("Socket %p type not supported in transparent mode", &sock);
+            sock.Finished();
+            return false;
+        }
+        count = 1;
+    }
+
+    unsigned row = ChannelRow(sock.IsSecure());
+    for (unsigned ch = 0; ch < count; ch++)
+    {
+        if (!channels[row][ch])
+        {
+            channels[row][ch] = &S(sock);
+            S(sock).row = row;
+            S(sock).channel = ch;
+            sock.packetSize = MaxPacket(sock.IsSecure());
+            sock.Allocate();
+            MYDBG("%s channel %d bound to socket %p", model == Model::SIM800 ? "TLS/TCP" : sock.IsSecure() ? "TLS" : "TCP", ch, &sock);
+            return true;
+        }
     }
 
     return false;
 }
 
+void SimComModem::FreeImpl(Socket& sock)
+{
+    if (&sock == linkSock)
+    {
+        linkSock = NULL;
+    }
+    auto& slot = ChannelSlot(sock);
+    if (slot == &sock)
+    {
+        slot = NULL;
+    }
+}
+
 async(SimComModem::ConnectImpl, Socket& sock)
 async_def()
 {
@@ -81,7 +93,31 @@ async_def()
             {
                 TcpStatus(TcpStatus::TlsError);
             }
-            else if (await(ATFormat, "+CIPSTART=%d,\"TCP\",\"%s\",\"%d\"", ((SimComSocket&)sock).channel, sock.host, sock.port))
+            else if (transparent)
+            {
+                // single connection mode, the modem switches to data mode after CONNECT
+                if (IsMultiplexed())
+                {
+                    // the connection gets a channel of its own, the AT channel stays in command mode
+                    linkCommand.Format("+CIPSTART=\"TCP\",", ATQuote(ConnectHost(sock)), ",\"", sock.port, '"');
+                    if (await(ConnectDataLink, sock))
+                    {
+                        async_return(true);
+                    }
+                }
+                else if (!(await(ATLock) ||
+                    NextATTimeout(ConnectTimeout()) ||
+                    NextATCommand("+CIPSTART=\"TCP\",", ATQuote(ConnectHost(sock)), ",\"", sock.port, '"') ||
+                    await(ATConnectData, sock)))
+                {
+                    sock.Bound();
+                    sock.Connected();
+                    async_return(true);
+                }
+                sock.Disconnected();
+                TcpStatus(TcpStatus::ConnectionError);
+            }
+            else if (await(ATFormat, "+CIPSTART=%d,\"%s\",\"%s\",\"%d\"", ((SimComSocket&)sock).channel, sock.IsDatagram() ? "UDP" : "TCP", ConnectHost(sock), sock.port))
             {
                 sock.Disconnected();
                 TcpStatus(TcpStatus::ConnectionError);
@@ -96,7 +132,40 @@ async_def()
         case Model::SIM7600:
             if (sock.IsSecure())
             {
-                if (!await(ATFormat, "+CCHOPEN=%d,\"%s\",%d,2", ((SimComSocket&)sock).channel, sock.host, sock.port))
+                if (!(await(PrepareTls, sock) ||
+                    await(ATFormat, "+CCHOPEN=%d,\"%s\",%d,2", ((SimComSocket&)sock).channel, sock.host, sock.port)))
+                {
+                    sock.Bound();
+                    async_return(true);
+                }
+            }
+            else if (transparent)
+            {
+                // the modem switches to data mode after CONNECT, there is no OK
+                if (IsMultiplexed())
+                {
+                    linkCommand.Format("+CIPOPEN=", S(sock).channel, ",\"TCP\",", ATQuote(ConnectHost(sock)), ',', sock.port);
+                    if (await(ConnectDataLink, sock))
+                    {
+                        async_return(true);
+                    }
+                }
+                else if (!(await(ATLock) ||
+                    NextATTimeout(ConnectTimeout()) ||
+                    NextATCommand("+CIPOPEN=", S(sock).channel, ",\"TCP\",", ATQuote(ConnectHost(sock)), ',', sock.port) ||
+                    await(ATConnectData, sock)))
+                {
+                    sock.Bound();
+                    sock.Connected();
+                    async_return(true);
+                }
+            }
+            else if (sock.IsDatagram())
+            {
+                // UDP sockets are not bound to the remote endpoint, it is specified with each +CIPSEND,
+                // the local port only needs to be unique among the channels
+                if (await(ResolveDatagram, sock) &&
+                    !await(ATFormat, "+CIPOPEN=%d,\"UDP\",,,%d", ((SimComSocket&)sock).channel, UdpLocalPort + ((SimComSocket&)sock).channel))
                 {
                     sock.Bound();
                     async_return(true);
@@ -104,7 +173,7 @@ async_def()
             }
             else
             {
-                if (!await(ATFormat, "+CIPOPEN=%d,\"TCP\",\"%s\",%d", ((SimComSocket&)sock).channel, sock.host, sock.port))
+                if (!await(ATFormat, "+CIPOPEN=%d,\"TCP\",\"%s\",%d", ((SimComSocket&)sock).channel, ConnectHost(sock), sock.port))
                 {
                     sock.Bound();
                     async_return(true);
@@ -122,12 +191,133 @@ async_def()
 }
 async_end
 
+async(SimComModem::ResolveDatagram, Socket& sock)
+async_def()
+{
+    // the name would otherwise be resolved by the modem with every datagram, or not at all
+    if (!IsAddressLiteral(ConnectHost(sock)) && !await(ResolveImpl, sock.host))
+    {
+        async_return(false);
+    }
+
+    const char* address = IsAddressLiteral(ConnectHost(sock)) ? ConnectHost(sock) : resolvedAddress;
+    size_t len = strlen(address);
+    if (len > DnsCache::MaxAddress)
+    {
+        MYDBG("Address %s too long", address);
+        async_return(false);
+    }
+    memcpy(S(sock).address, address, len + 1);
+    async_return(true);
+}
+async_end
+
+int SimComModem::TlsContextFor(const char* host)
+{
+    FNV1a fnv;
+    for (auto p = host; *p; p++)
+    {
+        fnv += *p;
+    }
+
+    for (unsigned i = 0; i < TlsContexts; i++)
+    {
+        if (tlsContexts[i].host == fnv)
+        {
+            return i;
+        }
+    }
+
+    for (unsigned n = 0; n < TlsContexts; n++)
+    {
+        unsigned i = (tlsContextNext + n) % TlsContexts;
+        if (!TlsContextInUse(i))
+        {
+            tlsContextNext = (i + 1) % TlsContexts;
+            tlsContexts[i].host = fnv;
+            tlsContexts[i].configured = false;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool SimComModem::TlsContextInUse(unsigned ctx)
+{
+    for (auto s: channels[ChannelRow(true)])
+    {
+        if (s && s->tlsContext == ctx + 1)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+async(SimComModem::PrepareTls, Socket& sock)
+async_def(
+    int ctx;
+)
+{
+    f.ctx = TlsContextFor(sock.host);
+    if (f.ctx < 0)
+    {
+        MYDBG("!! No SSL context available for %s", sock.host);
+        async_return(int(ATResult::Error));
+    }
+
+    S(sock).tlsContext = f.ctx + 1;
+    if (!tlsContexts[f.ctx].configured)
+    {
+        // first connection to the host, the context is kept for the following ones
+        MYDBG("SSL context %d for %s", f.ctx, sock.host);
+        if (await(ATFormat, "+CSSLCFG=\"sslversion\",%d,4", f.ctx) ||
+            await(ATFormat, "+CSSLCFG=\"authmode\",%d,0", f.ctx) ||
+            await(ATFormat, "+CSSLCFG=\"enableSNI\",%d,1", f.ctx) ||
+            await(ATFormat, "+CSSLCFG=\"negotiatetime\",%d,%d", f.ctx, TlsNegotiateSeconds))
+        {
+            async_return(int(ATResult::Error));
+        }
+        tlsContexts[f.ctx].configured = true;
+    }
+
+    async_return(await(ATFormat, "+CCHSSLCFG=%d,%d", S(sock).channel, f.ctx));
+}
+async_end
+
+async(SimComModem::ResolveImpl, Span host)
+async_def()
+{
+    // SIM800 reports the result after OK, SIM7600 before it
+    resolved = false;
+    resolving = host;
+    if (await(ATLock) ||
+        NextATTimeout(ConnectTimeout()) ||
+        NextATResponse(GetDelegate(this, &SimComModem::OnReceiveDns), 3) ||
+        NextATCommand("+CDNSGIP=", ATQuote(host)) ||
+        await(ATExecute))
+    {
+        MYDBG("Failed to resolve %b", host);
+        async_return(false);
+    }
+
+    if (!resolved)
+    {
+        MYDBG("%b not resolved", host);
+    }
+    async_return(resolved);
+}
+async_end
+
 async(SimComModem::SendPacketImpl, Socket& sock)
 async_def(
     SimComModem* self;
     SimComSocket* sock;
     size_t len;
     const char* type;
+    size_t offset;
+    ATResult res;
 
     async(OnReceiveAck, FNV1a header)
     async_def_sync()
@@ -135,12 +325,22 @@ async_def(
         int sent, ack, nak;
         if (header == "+CIPACK" && self->InputFieldNum(sent) && self->InputFieldNum(ack) && self->InputFieldNum(nak))
         {
+            // everything the modem has accepted is included, even the data it has not confirmed yet
             int curPos = unsafe_cast<int>(sock->OutputReader().Position());
-            if (curPos != sent)
+            if (sock->error && curPos != sent)
             {
                 MYDBG("Recovering after error, advancing %d to %d", sent - curPos, sent);
                 sock->OutputReader().Advance(sent - curPos);
             }
+            else if (!sock->error && curPos < sent)
+            {
+                // DATA ACCEPT is reported before the response, the data it has not confirmed has been lost
+                size_t n = std::min(size_t(sent - curPos), size_t(sock->inFlight));
+                MYDBG("Recovering %d bytes without DATA ACCEPT", n);
+                sock->OutputReader().Advance(n);
+                sock->inFlight -= n;
+            }
+            sock->unacked = std::min(nak, int(SendWindow800));
             sock->error = false;
             self->ATComplete(2);
         }
@@ -150,13 +350,67 @@ async_def(
 {
     f.self = this;
     f.sock = &S(sock);
-    f.len = std::min(size_t(MaxPacket), sock.OutputReader().Available());
+    if (&sock == linkSock)
+    {
+        // the data link passes the output to the connection as it is
+        f.len = sock.OutputReader().Available();
+        await(sock.OutputReader().MoveTo, linkTx, f.len);
+        async_return(f.len);
+    }
+
+    if (!sock.IsDatagram())
+    {
+        f.len = std::min(sock.PacketSize(), sock.OutputPending());
+    }
+    else if (!sock.NextDatagram(f.len))
+    {
+        async_return(0);
+    }
+    else if (f.len > MaxPacket(false))
+    {
+        MYDBG("Dropping %d byte datagram for socket %p, the modem cannot send more than %d bytes", f.len, &sock, MaxPacket(false));
+        if (sock.inFlight)
+        {
+            // the datagram can be dropped only once it gets to the head of the output
+            SendStalled800(S(sock));
+            async_return(0);
+        }
+        sock.OutputReader().Advance(Socket::DatagramHeader + f.len);
+        async_return(0);
+    }
 
     if (!f.len)
     {
         async_return(0);
     }
 
+    // the SIM800 sends are pipelined up to the window, DATA ACCEPT events confirm the data
+    // and may arrive after further sends have been issued
+    if (model == Model::SIM800 && !SendLimit800(S(sock), f.len) && !sock.IsDatagram())
+    {
+        // the window is full, +CIPACK tells how much of the data the modem has accepted,
+        // even if a DATA ACCEPT has been lost, and how much is still waiting for the remote side
+        if (await(ATLock))
+        {
+            async_return(false);
+        }
+
+        NextATResponse(GetDelegate(&f, &__FRAME::OnReceiveAck), 3);
+        NextATCommand("+CIPACK=", S(sock).channel);
+        if (await(ATExecute))
+        {
+            async_return(false);
+        }
+    }
+
+    if (model == Model::SIM800 && !(f.len = SendLimit800(S(sock), f.len)))
+    {
+        // nothing more can be sent until some of the data is confirmed
+        MYTRACE("Send window full for socket %p", &sock);
+        SendStalled800(S(sock));
+        async_return(0);
+    }
+
     if (await(ATLock))
     {
         async_return(false);
@@ -166,13 +420,14 @@ async_def(
     {
         // check actual ACK status after send failure
         NextATResponse(GetDelegate(&f, &__FRAME::OnReceiveAck), 3);
-        if (await(ATFormat, "+CIPACK=%d" , S(sock).channel))
+        NextATCommand("+CIPACK=", S(sock).channel);
+        if (await(ATExecute))
         {
             async_return(false);
         }
 
         // update output length, there may be changes...
-        f.len = std::min(size_t(MaxPacket), sock.OutputReader().Available());
+        f.len = SendLimit800(S(sock), std::min(sock.PacketSize(), sock.OutputPending()));
         if (!f.len)
         {
             async_return(0);
@@ -185,84 +440,160 @@ async_def(
         }
     }
 
+    if (model == Model::SIM800)
+    {
+        // the command completes once the data is transmitted, the confirmation is handled by OnSendResult800;
+        // the data is counted in advance, as the confirmation may be processed before this task resumes
+        S(sock).stalled = false;
+        f.offset = sock.inFlight + sock.OutputOverhead();
+        sock.inFlight += sock.OutputOverhead() + f.len;
+        sock.Sending();
+        NextATTransmit(sock, f.len, f.offset, true);
+        NextATCommand("+CIPSEND=", S(sock).channel, ',', f.len);
+        f.res = (ATResult)await(ATExecute);
+        if (f.res != ATResult::OK)
+        {
+            sock.inFlight -= std::min(size_t(sock.inFlight), sock.OutputOverhead() + f.len);
+            PacketFailed(S(sock));
+        }
+
+        sock.SendingFinished();
+        async_return(f.res == ATResult::OK);
+    }
+
     S(sock).outgoing = S(sock).lastSent = f.len;
     sock.Sending();
-    NextATTransmit(sock, f.len);
+    NextATTransmit(sock, f.len, sock.OutputOverhead());
     f.type = "IP";
-    if (model == Model::SIM800)
+    // SIM7600 sends both OK and +CCH/IPSEND response
+    NextATResponse(GetDelegate(this, &SimComModem::OnSendResponse7600), 3);
+    if (sock.IsSecure())
+    {
+        f.type = "CH";
+    }
+    if (sock.IsDatagram())
     {
-        // SIM800 sends just DATA ACCEPT or SEND FAIL
-        NextATResponse(GetDelegate(this, &SimComModem::OnSendResponse800), 2);
+        // SIM7600 UDP sockets need the destination with each datagram
+        NextATCommand("+CIPSEND=", S(sock).channel, ',', f.len, ',', ATQuote(S(sock).address), ',', sock.port);
     }
     else
     {
-        // SIM7600 sends both OK and +CCH/IPSEND response
-        NextATResponse(GetDelegate(this, &SimComModem::OnSendResponse7600), 3);
-        if (sock.IsSecure())
-        {
-            f.type = "CH";
-        }
+        NextATCommand("+C", f.type, "SEND=", S(sock).channel, ',', f.len);
     }
-    auto res = (ATResult)await(ATFormat, "+C%sSEND=%d,%d", f.type, S(sock).channel, f.len);
+    auto res = (ATResult)await(ATExecute);
     if (sock.IsSending())
     {
         MYDBG("Sending TIMED OUT for socket %p", &sock);
         sock.SendingFinished();
         S(sock).outgoing = 0;
+        PacketFailed(S(sock));
     }
     async_return(res == ATResult::OK);
 }
 async_end
 
-async(SimComModem::OnSendResponse800, FNV1a header)
-async_def_sync()
+void SimComModem::PacketSent(SimComSocket& sock)
 {
-    if (header == "DATA ACCEPT")
+    // grow the packet size back after a run of successful sends
+    if (++sock.sendStreak < PacketGrowStreak)
+        return;
+
+    sock.sendStreak = 0;
+    size_t max = MaxPacket(sock.IsSecure());
+    if (sock.packetSize < max)
     {
-        int ch, len;
-        if (InputFieldNum(ch) && InputFieldNum(len))
-        {
-            // data accepted
-            Socket* s = FindSocket(ch, true);
-            if (!s)
-            {
-                MYDBG("Send confirmation (%d) for unallocated TCP socket %d", len, ch);
-            }
-            else
-            {
-                MYTRACE("%d bytes accepted for socket %p", len, s);
-                ASSERT((size_t)len == S(s)->outgoing);
-                s->SendingFinished();
-                s->OutputReader().Advance(len);
-                S(s)->outgoing = 0;
-            }
-        }
-        ATComplete(2);   // this event arrives instead of OK
+        sock.packetSize = std::min(size_t(sock.packetSize) * 2, max);
+        MYDBG("Packet size for socket %p increased to %d", &sock, sock.packetSize);
     }
-    else if (header == "SEND FAIL")
+}
+
+void SimComModem::PacketFailed(SimComSocket& sock)
+{
+    sock.sendStreak = 0;
+    if (sock.packetSize > MinPacket)
     {
-        uint8_t ch = Input().Peek(0) - '0';
-        Socket* s = FindSocket(ch, true);
-        if (!s)
+        sock.packetSize = std::max(size_t(sock.packetSize) / 2, size_t(MinPacket));
+        MYDBG("Packet size for socket %p reduced to %d", &sock, sock.packetSize);
+    }
+}
+
+size_t SimComModem::SendLimit800(const SimComSocket& sock, size_t len) const
+{
+    size_t used = sock.inFlight + sock.unacked;
+    size_t space = SendWindow800 - std::min(used, size_t(SendWindow800));
+    if (!sock.IsDatagram())
+    {
+        return std::min(len, space);
+    }
+    // a datagram is never split, but it is sent if the window is empty even if it is larger
+    return used && Socket::DatagramHeader + len > space ? 0 : len;
+}
+
+void SimComModem::SendStalled800(SimComSocket& sock)
+{
+    mono_t now = MONO_CLOCKS;
+    if (!sock.stalled)
+    {
+        sock.stalled = true;
+        sock.stalledSince = now;
+    }
+    else if (sock.inFlight && now - sock.stalledSince >= StallTimeoutMs * (MONO_FREQUENCY / 1000))
+    {
+        MYDBG("!! No send confirmation for socket %p in %d ms, %d bytes in flight", &sock, StallTimeoutMs, sock.inFlight);
+        sock.stalledSince = now;
+        if (sock.IsDatagram())
         {
-            MYDBG("Send fail for unallocated TCP socket %d", ch);
+            // datagrams are not retransmitted, the ones in flight are lost
+            sock.OutputReader().Advance(sock.inFlight);
         }
         else
         {
-            MYDBG("Sending failed for socket %p", s);
-            s->SendingFinished();
-            S(s)->outgoing = 0;
-            S(s)->error = true;
+            // the position is recovered from +CIPACK before the next send, as after SEND FAIL
+            sock.error = true;
         }
-        ATComplete(2);   // this event arrives instead of OK
+        sock.inFlight = 0;
+        PacketFailed(sock);
     }
+
+    // check again later, DATA ACCEPT cancels the wait
+    sock.Backoff(StallCheckMs);
 }
-async_end
 
 async(SimComModem::OnSendResponse7600, FNV1a header)
 async_def_sync()
 {
-    if (header == "+CCHSEND")
+    if (header == "+CIPSEND")
+    {
+        int ch, req, cnf;
+        if (InputFieldNum(ch) && InputFieldNum(req) && InputFieldNum(cnf))
+        {
+            Socket* s = FindSocket(ch, false);
+            if (!s)
+            {
+                MYDBG("Send confirmation (%d) for unallocated IP socket %d", cnf, ch);
+            }
+            else
+            {
+                if (cnf < 0)
+                {
+                    MYDBG("Sending failed for socket %p", s);
+                    PacketFailed(*S(s));
+                }
+                else
+                {
+                    MYTRACE("%d of %d bytes sent for socket %p", cnf, req, s);
+                    // the unsent part of a datagram is lost
+                    s->OutputReader().Advance(s->OutputOverhead() + (s->IsDatagram() ? S(s)->outgoing : cnf));
+                    PacketSent(*S(s));
+                }
+
+                S(s)->outgoing = 0;
+                s->SendingFinished();
+            }
+        }
+        ATComplete(2);
+    }
+    else if (header == "+CCHSEND")
     {
         int ch, err;
         if (InputFieldNum(ch) && InputFieldNum(err))
@@ -278,11 +609,13 @@ async_def_sync()
                 if (err)
                 {
                     MYDBG("Sending failed (%d) for socket %p", err, s);
+                    PacketFailed(*S(s));
                 }
                 else
                 {
                     MYTRACE("Packet sent for socket %p", s);
                     s->OutputReader().Advance(S(s)->outgoing);
+                    PacketSent(*S(s));
                 }
 
                 S(s)->outgoing = 0;
@@ -298,7 +631,13 @@ async(SimComModem::ReceivePacketImpl, Socket& sock)
 async_def()
 {
     sock.IncomingRequested();
-    async_return(!await(ATFormat, "+CCHRECV=%d,%d", S(sock).channel, MaxPacket));
+    // request only as much as the socket can take, the rest stays buffered in the modem;
+    // without an input limit this is always MaxReceive, see ModemOptions::UseBufferedTlsReceive
+    S(sock).pullRequested = std::min(sock.InputSpace(), size_t(MaxReceive));
+    S(sock).pullReceived = 0;
+    async_return(!(await(ATLock) ||
+        NextATCommand("+CCHRECV=", S(sock).channel, ',', int(S(sock).pullRequested)) ||
+        await(ATExecute)));
 }
 async_end
 
@@ -316,7 +655,7 @@ async_def()
     switch (model)
     {
         case Model::SIM800:
-            if (!await(ATFormat, "+CIPCLOSE=%d", S(sock).channel))
+            if (!(transparent ? await(AT, "+CIPCLOSE") : await(ATFormat, "+CIPCLOSE=%d", S(sock).channel)))
             {
                 async_return(true);
             }
@@ -480,6 +819,10 @@ async_end
 async(SimComModem::Initialize)
 async_def(
     ModemOptions::Parity parity;
+    Span cmds[8];
+    size_t n;
+    unsigned n1;
+    ATResult res;
 )
 {
     model = Model::Unknown;
@@ -549,21 +892,37 @@ async_def(
         }
     }
 
-    if (await(AT, "+CMEE=2") ||     // extended error reporting
-        (model == Model::SIM800 && await(AT, "+CSDT=0")) ||     // SIM card detection off
-        await(AT, "+CREG=2") ||     // extended network registration notifications
-        await(AT, "+CGREG=2") ||    // extended GPRS network registration notifications
-        // network timestamp notifications
-        (model == Model::SIM800 && await(AT, "+CLTS=1")) ||
-        (model == Model::SIM7600 && await(AT, "+CTZR=1")) ||
-        // signal strength and error rate
-        (model == Model::SIM800 && await(AT, "+EXUNSOL=\"SQ\",1")) ||
-        (model == Model::SIM7600 && await(AT, "+AUTOCSQ=1,1")) ||
-        // network info
-        (model == Model::SIM800 && await(AT, "+CR=1")) ||
-        (model == Model::SIM7600 && await(AT, "+CPSI=10")) ||
-        false)
+    f.n = 0;
+    f.cmds[f.n++] = "+CMEE=2";      // extended error reporting
+    if (model == Model::SIM800)
+    {
+        f.cmds[f.n++] = "+CSDT=0";  // SIM card detection off
+    }
+    f.cmds[f.n++] = "+CREG=2";      // extended network registration notifications
+    f.cmds[f.n++] = "+CGREG=2";     // extended GPRS network registration notifications
+    if (Options().UseMultiplexer())
+    {
+        f.cmds[f.n++] = "&C1";      // DCD reports the connection state, the data link detects the lost connection by it
+    }
+    if (model == Model::SIM800)
+    {
+        f.cmds[f.n++] = "+CLTS=1";              // network timestamp notifications
+        f.cmds[f.n++] = "+EXUNSOL=\"SQ\",1";    // signal strength and error rate
+        f.cmds[f.n++] = "+CR=1";                // network info
+    }
+    else
+    {
+        f.cmds[f.n++] = "+CTZR=1";              // network timestamp notifications
+        f.cmds[f.n++] = "+AUTOCSQ=1,1";         // signal strength and error rate
+        f.cmds[f.n++] = "+CPSI=10";             // network info
+    }
+
+    if (await(ATBatch, f.cmds, f.n))
     {
+        if (ATBatchFailed() < f.n)
+        {
+            MYDBG("AT%b failed", f.cmds[ATBatchFailed()]);
+        }
         async_return(false);
     }
 
@@ -573,18 +932,213 @@ async_def(
         await_mask_not_sec(cfun, 0xFF, 0, 5);
     }
 
+    if (Options().UseMultiplexer())
+    {
+        MYDBG("Starting multiplexer");
+        // nothing may be left waiting on the pipes of the previous session
+        if (!await(mux.Reset, Timeout::Seconds(1)) ||
+            await(ATLock))
+        {
+            async_return(false);
+        }
+
+        // the port speed is left unchanged, older firmware rejects a longer N1 so the default is used then
+        f.n1 = ModelMuxInfo();
+        NextATCommand("+CMUX=0,0,,", f.n1);
+        f.res = (ATResult)await(ATSwitchPipe, mux.Channel(1));
+        if (f.res == ATResult::Error)
+        {
+            f.n1 = Cmux::DefaultInfo;
+            NextATCommand("+CMUX=0");
+            f.res = (ATResult)await(ATSwitchPipe, mux.Channel(1));
+        }
+        if (f.res != ATResult::OK)
+        {
+            async_return(false);
+        }
+
+        multiplexed = true;
+        // the auxiliary links are opened only when requested, see AuxChannel
+        if (!await(mux.Start, Timeout::Seconds(5), DataLink, f.n1))
+        {
+            // the AT engine stays on the first channel, which continues without framing
+            MYDBG("!! Multiplexer not started, closing down");
+            mux.Stop();
+            async_return(false);
+        }
+
+        linkState = LinkIdle;
+        linkSock = NULL;
+        kernel::Task::Run(this, &SimComModem::DataLinkTask);
+    }
+
     async_return(true);
 }
 async_end
 
-async(SimComModem::OnReceiveId, FNV1a header)
-async_def_sync()
+void SimComModem::OnTaskStopped()
 {
-    if (Input().Matches("SIM800"))
+    if (multiplexed)
     {
-        model = Model::SIM800;
+        // the multiplexer has shut down with the AT channel (the data link task with it),
+        // the next session starts on the plain link
+        multiplexed = false;
+        UsePipe(io::DuplexPipe(gsmRx, gsmTx));
     }
-    else if (header == "Model")
+}
+
+async(SimComModem::ConnectDataLink, Socket& sock)
+async_def()
+{
+    if (linkCommand.Overflow() || linkState != LinkIdle)
+    {
+        MYDBG("!! Data link not available for %p", &sock);
+        async_return(false);
+    }
+
+    MYTRACE("%d>> %b", DataLink, linkCommand.Command());
+    linkSock = &sock;
+    linkState = LinkConnecting;
+    if (await(linkTx.Write, linkCommand.Line()) != (int)linkCommand.Line().Length() ||
+        !await_mask_not_timeout(linkState, 0xFF, LinkConnecting, ConnectTimeout()))
+    {
+        MYDBG("!! Data link connection timed out");
+        linkState = LinkIdle;
+    }
+
+    if (linkState != LinkData)
+    {
+        linkState = LinkIdle;
+        linkSock = NULL;
+        DnsFailed(sock);
+        async_return(false);
+    }
+
+    sock.Bound();
+    sock.Connected();
+    async_return(true);
+}
+async_end
+
+async(SimComModem::DataLinkTask)
+async_def(
+    size_t len;
+    size_t tail;
+)
+{
+    while (await(linkRx.Require))
+    {
+        if (linkState == LinkData)
+        {
+            // everything belongs to the socket, except for the notification of the lost connection
+            f.len = linkRx.Available();
+            f.tail = DataLostNotification(linkRx, f.len);
+            if (f.len > f.tail)
+            {
+                if (linkSock)
+                {
+                    await(linkRx.MoveTo, linkSock->InputWriter(), f.len - f.tail);
+                }
+                else
+                {
+                    linkRx.Advance(f.len - f.tail);
+                }
+            }
+
+            if (f.tail)
+            {
+                // with AT&C1 the modem drops the carrier of the link when the connection is lost,
+                // the multiplexer may report it a bit later than the notification
+                if (await(mux.WaitCarrierLost, DataLink, Timeout::Milliseconds(CarrierLossMs)))
+                {
+                    linkRx.Advance(f.tail);
+                    DataLinkLost();
+                }
+                else if (linkSock)
+                {
+                    await(linkRx.MoveTo, linkSock->InputWriter(), f.tail);
+                }
+                else
+                {
+                    linkRx.Advance(f.tail);
+                }
+            }
+            continue;
+        }
+
+        if (linkRx.Peek(0) == '\r' || linkRx.Peek(0) == '\n')
+        {
+            linkRx.Advance(1);
+            continue;
+        }
+
+        if (!(f.len = await(linkRx.RequireUntil, '\r')))
+        {
+            if (linkRx.IsComplete())
+            {
+                linkRx.Advance(linkRx.Available());
+            }
+            continue;
+        }
+
+        MYTRACE("%d<< %b", DataLink, linkRx.GetSpan().Left(f.len - 1));
+        if (linkRx.Matches("CONNECT") && !linkRx.Matches("CONNECT FAIL") && (f.len == 8 || linkRx.Peek(7) == ' '))
+        {
+            // CONNECT [<rate>], the data follows right after the line
+            if (linkState != LinkConnecting)
+            {
+                MYDBG("!! Unexpected CONNECT on the data link");
+            }
+            linkState = LinkData;
+            linkRx.Advance(f.len);
+            if (await(linkRx.Require) && linkRx.Peek(0) == '\n')
+            {
+                linkRx.Advance(1);
+            }
+            continue;
+        }
+
+        if (linkState == LinkConnecting &&
+            (linkRx.Matches("CONNECT FAIL") || linkRx.Matches("ERROR") || linkRx.Matches("+CME ERROR") ||
+            linkRx.Matches("ALREADY CONNECT") || linkRx.Matches("+CIPOPEN")))
+        {
+            linkState = LinkFailed;
+        }
+        // the echo, OK and anything else is ignored
+        linkRx.Advance(f.len);
+    }
+
+    MYDBG("Data link closed");
+    DataLinkLost();
+}
+async_end
+
+void SimComModem::DataLinkLost()
+{
+    if (linkState == LinkData)
+    {
+        MYDBG("Connection lost on the data link");
+    }
+    linkState = LinkIdle;
+    if (linkSock)
+    {
+        if (linkSock->IsAllocated())
+        {
+            linkSock->Disconnected();
+        }
+        linkSock = NULL;
+        RequestProcessing();
+    }
+}
+
+async(SimComModem::OnReceiveId, FNV1a header)
+async_def_sync()
+{
+    if (Input().Matches("SIM800"))
+    {
+        model = Model::SIM800;
+    }
+    else if (header == "Model")
     {
         if (InputField().Matches("SIMCOM_") &&
             InputField().Matches("SIM7600", 7))
@@ -615,6 +1169,31 @@ async_def_sync()
 }
 async_end
 
+async(SimComModem::OnReceiveDns, FNV1a header)
+async_def_sync()
+{
+    if (header == "+CDNSGIP")
+    {
+        // +CDNSGIP: 1,<domain>,<ip>[,<ip2>] or +CDNSGIP: 0,<error>
+        int success;
+        if (InputFieldNumAt(0, success) && success == 1)
+        {
+            // stored under the requested name, the modem may echo it differently (e.g. lowercase)
+            Span address = InputFieldStringAt(2);
+            MYDBG("%b resolved to %b", resolving, address);
+            DnsResolved(resolving, address);
+            if (address.Length() <= DnsCache::MaxAddress)
+            {
+                memcpy(resolvedAddress, address.Pointer(), address.Length());
+                resolvedAddress[address.Length()] = 0;
+                resolved = true;
+            }
+        }
+        ATComplete(2);
+    }
+}
+async_end
+
 async(SimComModem::OnReceiveShutOK, FNV1a header)
 async_def_sync()
 {
@@ -707,10 +1286,9 @@ async_def(
     Timeout timeout;
 )
 {
-    if (await(AT, "+CREG?") ||
-        await(AT, "+CGREG?") ||
-        await(AT, "+COPS?") ||
-        await(AT, "+CSQ"))
+    static const Span queries[] = { "+CREG?", "+CGREG?", "+COPS?", "+CSQ" };
+
+    if (await(ATBatch, queries, countof(queries)))
     {
         async_return(false);
     }
@@ -747,12 +1325,16 @@ async_def()
     }
 
     gprs.attached = true;
+    transparent = Options().UseTransparentMode();
 
     MYDBG("Connecting GPRS...");
     if (model == Model::SIM800)
     {
         // enable socket multiplexing
-        if (await(AT, "+CIPMUX=1") || await(AT, "+CIPQSEND=1"))
+        static const Span mux[] = { "+CIPMUX=1", "+CIPQSEND=1" };
+        // or a single connection in transparent mode
+        static const Span single[] = { "+CIPMUX=0", "+CIPMODE=1" };
+        if (transparent ? await(ATBatch, single, countof(single)) : await(ATBatch, mux, countof(mux)))
         {
             async_return(false);
         }
@@ -809,13 +1391,22 @@ async_def()
             }
         }
 
+        // selected by +CCHSET below, TLS data is either pushed by the modem or requested using +CCHRECV
+        tlsBuffered = Options().UseBufferedTlsReceive();
+
+        // transparent mode must be selected before the network is opened
+        if (transparent && await(AT, "+CIPMODE=1"))
+        {
+            async_return(false);
+        }
+
         // activate TCP and TLS
         if (await(ATLock) ||
             NextATTimeout(Timeout::Seconds(60)) ||
             NextATResponse(GetDelegate(this, &SimComModem::OnReceiveNetCch), 3) ||
             await(AT, "+NETOPEN") ||
             net.error ||
-            await(AT, "+CCHSET=1,0") ||
+            await(ATFormat, "+CCHSET=1,%d", tlsBuffered) ||
             await(ATLock) ||
             NextATResponse(GetDelegate(this, &SimComModem::OnReceiveNetCch), 3) ||
             await(AT, "+CCHSTART") ||
@@ -824,6 +1415,12 @@ async_def()
             async_return(false);
         }
 
+        // SSL contexts do not survive a restart of the modem
+        for (auto& ctx: tlsContexts)
+        {
+            ctx.configured = false;
+        }
+
         // get local IP
         if (await(AT, "+IPADDR"))
         {
@@ -838,339 +1435,524 @@ async_end
 async(SimComModem::OnEvent, FNV1a hash)
 async_def_sync()
 {
-    switch (hash)
+    async_return(DispatchEvent(hash));
+}
+async_end
+
+bool SimComModem::DispatchEvent(FNV1a hash)
+{
+    static constexpr URCEntry<SimComModem> entries[] = {
+        { fnv1a("+CSQ"), &SimComModem::OnSignalQuality },
+        { fnv1a("+CSQN"), &SimComModem::OnSignalQuality },
+        { fnv1a("+CREG"), &SimComModem::OnRegistration },
+        { fnv1a("+CGREG"), &SimComModem::OnRegistration },
+        { fnv1a("+CPIN"), &SimComModem::OnPinStatus },
+        { fnv1a("+CCHOPEN"), &SimComModem::OnTlsOpen },
+        { fnv1a("+CIPOPEN"), &SimComModem::OnIpOpen },
+        { fnv1a("CONNECT OK"), &SimComModem::OnConnectOK },
+        { fnv1a("DATA ACCEPT"), &SimComModem::OnSendResult800 },
+        { fnv1a("SEND FAIL"), &SimComModem::OnSendResult800 },
+        { fnv1a("CONNECT FAIL"), &SimComModem::OnConnectFail },
+        { fnv1a("+CCHCLOSE"), &SimComModem::OnTlsClosed },
+        { fnv1a("+CCH_PEER_CLOSED"), &SimComModem::OnTlsClosed },
+        { fnv1a("CLOSE OK"), &SimComModem::OnClosed },
+        { fnv1a("CLOSED"), &SimComModem::OnClosed },
+        { fnv1a("+CIPCLOSE"), &SimComModem::OnIpClosed },
+        { fnv1a("+IPCLOSE"), &SimComModem::OnIpClosed },
+        { fnv1a("+CCHRECV"), &SimComModem::OnTlsReceive },
+        { fnv1a("+RECEIVE,"), &SimComModem::OnReceive },
+        { fnv1a("+CCHEVENT"), &SimComModem::OnTlsEvent },
+        { fnv1a("+CPSI"), &SimComModem::OnSystemInfo },
+        { fnv1a("+CIEV"), &SimComModem::OnIgnored },   // TODO: SIM800 network info
+        { fnv1a("+CFUN"), &SimComModem::OnFunctionality },
+        // events we don't want to handle
+        { fnv1a("+CTZV"), &SimComModem::OnIgnored },
+        { fnv1a("+COPS"), &SimComModem::OnIgnored },
+        { fnv1a("+IPADDR"), &SimComModem::OnIgnored },
+        { fnv1a("RECV FROM"), &SimComModem::OnIgnored },   // SIM7600 source of received UDP data
+        { fnv1a("+PDP"), &SimComModem::OnIgnored },
+        { fnv1a("RDY"), &SimComModem::OnIgnored },
+        { fnv1a("Call Ready"), &SimComModem::OnIgnored },
+        { fnv1a("SMS Ready"), &SimComModem::OnIgnored },
+        { fnv1a("*PSUTTZ"), &SimComModem::OnIgnored },
+        { fnv1a("DST"), &SimComModem::OnIgnored },
+    };
+    static constexpr auto table = MakeURCTable(entries);
+    static_assert(table.Valid(), "URC hash collision");
+
+    return table.Dispatch(*this, hash);
+}
+
+bool SimComModem::OnIgnored(FNV1a hash)
+{
+    return true;
+}
+
+bool SimComModem::OnSignalQuality(FNV1a hash)
+{
+    int rssi, ber;
+    if (InputFieldNum(rssi) && InputFieldNum(ber))
     {
-        case fnv1a("+CSQ"):
-        case fnv1a("+CSQN"):
-        {
-            int rssi, ber;
-            if (InputFieldNum(rssi) && InputFieldNum(ber))
-            {
-                net.rssi = rssi <= 31 ? -113 + rssi * 2 :
-                    rssi >= 100 && rssi <= 191 ? -116 + rssi :
-                    0;
-                net.ber = ber <= 7 ? ber + 1 : 0;
-                Rssi(net.rssi);
-                MYDBG("RSSI: %d, BER: %s", net.rssi, STRINGS("UNK", "<0.01%", "<0.1%", "<0.5%", "<1%", "<2%", "<4%", "<8%", ">=8%")[net.ber]);
-            }
-            async_return(true);
-        }
+        net.rssi = rssi <= 31 ? -113 + rssi * 2 :
+            rssi >= 100 && rssi <= 191 ? -116 + rssi :
+            0;
+        net.ber = ber <= 7 ? ber + 1 : 0;
+        Rssi(net.rssi);
+        MYDBG("RSSI: %d, BER: %s", net.rssi, STRINGS("UNK", "<0.01%", "<0.1%", "<0.5%", "<1%", "<2%", "<4%", "<8%", ">=8%")[net.ber]);
+    }
+    return true;
+}
 
-        case fnv1a("+CREG"):
-        case fnv1a("+CGREG"):
-        {
-            int stat, lac, ci;
-            bool isGprs = hash == fnv1a("+CGREG");
-            RegBase& reg = *(isGprs ? (RegBase*)&gprs : &net);
+bool SimComModem::OnRegistration(FNV1a hash)
+{
+    int stat, lac, ci;
+    bool isGprs = hash == fnv1a("+CGREG");
+    RegBase& reg = *(isGprs ? (RegBase*)&gprs : &net);
 
-            switch (InputFieldCount())
-            {
-                case 4:
-                case 2:
-                    // response to +CREG?, first field is mode
-                    InputFieldNum(stat);
-                    break;
-            }
+    // unsolicited event is <stat>[,<lac>,<ci>...],
+    // response to +CREG? has an additional <n> field at the beginning
+    unsigned n = InputFieldCount();
+    unsigned i = n == 2 || n == 4 ? 1 : 0;
 
-            if (InputFieldNum(stat))
-            {
-                reg.status = (Registration)stat;
-                reg.active = reg.status == Registration::Home || reg.status == Registration::Roaming;
+    if (InputFieldNumAt(i, stat))
+    {
+        reg.status = (Registration)stat;
+        reg.active = reg.status == Registration::Home || reg.status == Registration::Roaming;
 
-                if (!IsDisconnecting()) // do not update status during network disconnect
-                {
-                    GsmStatus(reg.status == Registration::Home ? GsmStatus::Ok :
-                        reg.status == Registration::Roaming ? GsmStatus::Roaming :
-                        GsmStatus::Searching);
-                }
+        if (!IsDisconnecting()) // do not update status during network disconnect
+        {
+            GsmStatus(reg.status == Registration::Home ? GsmStatus::Ok :
+                reg.status == Registration::Roaming ? GsmStatus::Roaming :
+                GsmStatus::Searching);
+        }
 
-                if (InputFieldHex(lac) && InputFieldHex(ci))
-                {
-                    reg.lac = lac;
-                    reg.ci = ci;
-                    MYDBG("%s: %s, LAC: %04X, CI: %04X", isGprs ? "GPRS" : "GSM", net.StatusName(), lac, ci);
-                }
-                else
-                {
-                    MYDBG("%s: %s", isGprs ? "GPRS" : "GSM", net.StatusName());
-                }
-            }
-            async_return(true);
+        if (InputFieldHexAt(i + 1, lac) && InputFieldHexAt(i + 2, ci))
+        {
+            reg.lac = lac;
+            reg.ci = ci;
+            MYDBG("%s: %s, LAC: %04X, CI: %04X", isGprs ? "GPRS" : "GSM", net.StatusName(), lac, ci);
+        }
+        else
+        {
+            MYDBG("%s: %s", isGprs ? "GPRS" : "GSM", net.StatusName());
         }
+    }
+    return true;
+}
 
-        case fnv1a("+CPIN"):
-            if (InputField().Matches("READY"))
-            {
-                sim.ready = true;
-            }
-            async_return(true);
+bool SimComModem::OnPinStatus(FNV1a hash)
+{
+    if (InputField().Matches("READY"))
+    {
+        sim.ready = true;
+    }
+    return true;
+}
 
-        case fnv1a("+CCHOPEN"):
+bool SimComModem::OnTlsOpen(FNV1a hash)
+{
+    int ch, status;
+    if (InputFieldNum(ch) && InputFieldNum(status))
+    {
+        Socket* s = FindSocket(ch, true);
+        if (!s)
         {
-            int ch, status;
-            if (InputFieldNum(ch) && InputFieldNum(status))
-            {
-                Socket* s = FindSocket(ch, true);
-                if (!s)
-                {
-                    MYDBG("Status arrived for unallocated TLS socket %d", ch);
-                }
-                else
-                {
-                    if (!status)
-                    {
-                        MYDBG("%p connected", s);
-                        s->Connected();
-                    }
-                    else
-                    {
-                        MYDBG("%p connection failed: %d", s, status);
-                        s->Disconnected();
-                    }
-                    RequestProcessing();
-                }
-            }
-            async_return(true);
+            MYDBG("Status arrived for unallocated TLS socket %d", ch);
         }
-
-        case fnv1a("CONNECT OK"):
+        else
         {
-            uint8_t ch = Input().Peek(0) - '0';
-            Socket* s = FindSocket(ch, true);
-            if (!s)
+            if (!status)
             {
-                MYDBG("Status arrived for unallocated TCP socket %d", ch);
+                s->Connected();
+                MYDBG("%p connected in %d ms", s, s->ConnectTime());
             }
             else
             {
-                MYDBG("%p connected", s);
-                s->Connected();
-                RequestProcessing();
+                MYDBG("%p connection failed: %d", s, status);
+                s->Disconnected();
             }
-            async_return(true);
+            RequestProcessing();
         }
+    }
+    return true;
+}
 
-        case fnv1a("+CCHCLOSE"):
-        case fnv1a("+CCH_PEER_CLOSED"):
+bool SimComModem::OnIpOpen(FNV1a hash)
+{
+    int ch, err;
+    if (InputFieldNum(ch) && InputFieldNum(err))
+    {
+        Socket* s = FindSocket(ch, false);
+        if (!s)
         {
-            int ch, status;
-            if (InputFieldNum(ch) && (hash == fnv1a("+CCH_PEER_CLOSED") || InputFieldNum(status)))
-            {
-                Socket* s = FindSocket(ch, true);
-                if (!s)
-                {
-                    MYDBG("Status arrived for unallocated TLS socket %d", ch);
-                }
-                else
-                {
-                    MYDBG("%p disconnected", s);
-                    s->Disconnected();
-                    RequestProcessing();
-                }
-            }
-            async_return(true);
+            MYDBG("Status arrived for unallocated IP socket %d", ch);
         }
-
-        case fnv1a("CLOSE OK"):
-            ATComplete();   // this event arrives instead of OK
-            // fall through
-
-        case fnv1a("CLOSED"):
+        else
         {
-            uint8_t ch = Input().Peek(0) - '0';
-            Socket* s = FindSocket(ch, true);
-            if (!s)
+            if (!err)
             {
-                MYDBG("Status arrived for unallocated TCP socket %d", ch);
+                s->Connected();
+                MYDBG("%p connected in %d ms", s, s->ConnectTime());
             }
             else
             {
-                MYDBG("%p disconnected", s);
+                MYDBG("%p connection failed: %d", s, err);
+                DnsFailed(*s);
                 s->Disconnected();
-                RequestProcessing();
             }
-            async_return(true);
+            RequestProcessing();
         }
+    }
+    return true;
+}
 
-        case fnv1a("+CCHRECV"):
+bool SimComModem::OnConnectOK(FNV1a hash)
+{
+    uint8_t ch = Input().Peek(0) - '0';
+    Socket* s = FindSocket(ch, false);
+    if (!s)
+    {
+        MYDBG("Status arrived for unallocated TCP socket %d", ch);
+    }
+    else
+    {
+        s->Connected();
+        MYDBG("%p connected in %d ms", s, s->ConnectTime());
+        RequestProcessing();
+    }
+    return true;
+}
+
+bool SimComModem::OnSendResult800(FNV1a hash)
+{
+    SimComSocket* s;
+    if (hash == fnv1a("DATA ACCEPT"))
+    {
+        int ch, len;
+        if (!(InputFieldNum(ch) && InputFieldNum(len)))
+        {
+            return true;
+        }
+
+        s = FindSocket(ch, false);
+        if (!s)
         {
-            uint32_t type;
-            int ch, len, err;
-            if (InputFieldCount() == 2 && InputFieldNum(ch) && InputFieldNum(err))
+            MYDBG("Send confirmation (%d) for unallocated TCP socket %d", len, ch);
+            return true;
+        }
+
+        if (!s->error)
+        {
+            // the confirmations arrive in the order of the sends
+            size_t n = s->OutputOverhead() + len;
+            if (n > s->inFlight)
             {
-                // end of receive
-                Socket* s = FindSocket(ch, true);
-                if (!s)
-                {
-                    MYDBG("End of receive arrived for unallocated TLS socket %d", ch);
-                }
-                else if (err)
-                {
-                    MYDBG("%p disconnected", s);
-                    s->Disconnected();
-                    RequestProcessing();
-                }
-                else
-                {
-                    // look for more data
-                    s->MaybeIncoming();
-                    RequestProcessing();
-                }
+                MYDBG("!! Confirmation of %d bytes for socket %p with %d bytes in flight", len, s, s->inFlight);
+                n = s->inFlight;
             }
-            else if (InputFieldFnv(type))
+            MYTRACE("%d bytes accepted for socket %p", len, s);
+            s->OutputReader().Advance(n);
+            s->inFlight -= n;
+            if (!s->IsDatagram())
             {
-                switch (type)
-                {
-                case fnv1a("DATA"):
-                    if (InputFieldNum(ch) && InputFieldNum(len))
-                    {
-                        // data received for channel
-                        Socket* s = FindSocket(ch, true);
-                        if (!s)
-                        {
-                            MYDBG("Incoming %d bytes of data for unallocated TLS socket %d", len, ch);
-                        }
-                        else
-                        {
-                            MYTRACE("Incoming %d bytes of data for socket %p", len, s);
-                            s->MaybeIncoming();
-                        }
-                        RequestProcessing();
-                        ReceiveForSocket(s, len);
-                    }
-                    break;
-
-                case fnv1a("LEN"):
-                    for (ch = 0; InputFieldNum(len); ch++)
-                    {
-                        if (len)
-                        {
-                            Socket* s = FindSocket(ch, true);
-                            if (!s)
-                            {
-                                MYDBG("Unallocated TLS socket %d has %d data in the buffer", ch, len);
-                            }
-                            else
-                            {
-                                MYTRACE("%d bytes of data in socket %p buffer", len, s);
-                                s->Incoming();
-                                RequestProcessing();
-                            }
-                        }
-                    }
-                    break;
-                }
+                // the data stays in the send buffer until the remote side acknowledges it
+                s->unacked = std::min(size_t(s->unacked) + len, size_t(SendWindow800));
             }
-            async_return(true);
+            PacketSent(*s);
+        }
+        // otherwise +CIPACK tells how much of the data has been accepted
+    }
+    else
+    {
+        uint8_t ch = Input().Peek(0) - '0';
+        s = FindSocket(ch, false);
+        if (!s)
+        {
+            MYDBG("Send fail for unallocated TCP socket %d", ch);
+            return true;
         }
 
-        case fnv1a("+RECEIVE,"):
+        MYDBG("Sending failed for socket %p", s);
+        if (s->IsDatagram())
         {
-            int ch, len;
-            if (InputFieldNum(ch) && InputFieldNum(len), len)    // InputFieldNum(len) will return an error, since the length is followed by a colon
+            // datagrams are not retransmitted, the one at the head of the output is lost
+            auto reader = s->OutputReader();
+            size_t n = std::min(s->OutputOverhead() + (uint8_t(reader.Peek(0)) | uint8_t(reader.Peek(1)) << 8), size_t(s->inFlight));
+            reader.Advance(n);
+            s->inFlight -= n;
+        }
+        else if (!s->error)
+        {
+            // the further data in flight is not confirmed individually,
+            // the position is recovered from +CIPACK before the next send
+            s->error = true;
+            s->inFlight = 0;
+        }
+        PacketFailed(*s);
+    }
+
+    if (s->stalled)
+    {
+        // the window has moved, try sending again right away
+        s->stalled = false;
+        s->Backoff(0);
+    }
+    RequestProcessing();
+    return true;
+}
+
+bool SimComModem::OnConnectFail(FNV1a hash)
+{
+    // there is no channel number in single connection mode
+    uint8_t ch = transparent ? 0 : Input().Peek(0) - '0';
+    Socket* s = FindSocket(ch, false);
+    if (!s)
+    {
+        MYDBG("Status arrived for unallocated TCP socket %d", ch);
+    }
+    else
+    {
+        MYDBG("%p connection failed", s);
+        DnsFailed(*s);
+        s->Disconnected();
+        RequestProcessing();
+    }
+    return true;
+}
+
+bool SimComModem::OnTlsClosed(FNV1a hash)
+{
+    int ch, status;
+    if (InputFieldNum(ch) && (hash == fnv1a("+CCH_PEER_CLOSED") || InputFieldNum(status)))
+    {
+        Socket* s = FindSocket(ch, true);
+        if (!s)
+        {
+            MYDBG("Status arrived for unallocated TLS socket %d", ch);
+        }
+        else
+        {
+            MYDBG("%p disconnected", s);
+            s->Disconnected();
+            RequestProcessing();
+        }
+    }
+    return true;
+}
+
+bool SimComModem::OnClosed(FNV1a hash)
+{
+    if (hash == fnv1a("CLOSE OK"))
+    {
+        ATComplete();   // this event arrives instead of OK
+    }
+
+    // there is no channel number in single connection mode
+    uint8_t ch = transparent ? 0 : Input().Peek(0) - '0';
+    Socket* s = FindSocket(ch, false);
+    if (!s)
+    {
+        MYDBG("Status arrived for unallocated TCP socket %d", ch);
+    }
+    else
+    {
+        MYDBG("%p disconnected", s);
+        s->Disconnected();
+        RequestProcessing();
+    }
+    return true;
+}
+
+bool SimComModem::OnIpClosed(FNV1a hash)
+{
+    int ch;
+    if (InputFieldNum(ch))
+    {
+        Socket* s = FindSocket(ch, false);
+        if (!s)
+        {
+            MYDBG("Status arrived for unallocated IP socket %d", ch);
+        }
+        else
+        {
+            MYDBG("%p disconnected", s);
+            s->Disconnected();
+            RequestProcessing();
+        }
+    }
+    return true;
+}
+
+bool SimComModem::OnTlsReceive(FNV1a hash)
+{
+    uint32_t type;
+    int ch, len, err;
+    if (InputFieldCount() == 2 && InputFieldNum(ch) && InputFieldNum(err))
+    {
+        // end of receive
+        Socket* s = FindSocket(ch, true);
+        if (!s)
+        {
+            MYDBG("End of receive arrived for unallocated TLS socket %d", ch);
+        }
+        else if (err)
+        {
+            MYDBG("%p disconnected", s);
+            s->Disconnected();
+            RequestProcessing();
+        }
+        else if (!tlsBuffered)
+        {
+            // look for more data
+            s->MaybeIncoming();
+            RequestProcessing();
+        }
+        else if (S(s)->pullReceived >= S(s)->pullRequested)
+        {
+            // the request has been filled completely, there may be more data left in the modem,
+            // otherwise the modem reports the next data using RECV EVENT
+            s->Incoming();
+            RequestProcessing();
+        }
+    }
+    else if (InputFieldFnv(type))
+    {
+        switch (type)
+        {
+        case fnv1a("DATA"):
+            if (InputFieldNum(ch) && InputFieldNum(len))
             {
                 // data received for channel
                 Socket* s = FindSocket(ch, true);
                 if (!s)
                 {
-                    MYDBG("Incoming %d bytes of data for unallocated TCP socket %d", len, ch);
+                    MYDBG("Incoming %d bytes of data for unallocated TLS socket %d", len, ch);
                 }
                 else
                 {
                     MYTRACE("Incoming %d bytes of data for socket %p", len, s);
-                    s->MaybeIncoming();
+                    if (tlsBuffered)
+                    {
+                        S(s)->pullReceived += len;
+                    }
+                    else
+                    {
+                        s->MaybeIncoming();
+                    }
                 }
                 RequestProcessing();
                 ReceiveForSocket(s, len);
             }
-            async_return(true);
-        }
+            break;
 
-        case fnv1a("+CCHEVENT"):
-        {
-            int ch;
-            uint32_t type;
-            if (InputFieldNum(ch) && InputFieldFnv(type) && type == fnv1a("RECV EVENT"))
+        case fnv1a("LEN"):
+            for (ch = 0; InputFieldNum(len); ch++)
             {
-                // buffered data received for channel
-                Socket* s = FindSocket(ch, true);
-                if (!s)
-                {
-                    MYDBG("Indicated incoming data for unallocated TLS socket %d", ch);
-                }
-                else
+                if (len)
                 {
-                    MYTRACE("Indicated data for socket %p", s);
+                    Socket* s = FindSocket(ch, true);
+                    if (!s)
+                    {
+                        MYDBG("Unallocated TLS socket %d has %d data in the buffer", ch, len);
+                    }
+                    else
+                    {
+                        MYTRACE("%d bytes of data in socket %p buffer", len, s);
+                        s->Incoming();
+                        RequestProcessing();
+                    }
                 }
-                s->Incoming();
-                RequestProcessing();
             }
-            async_return(true);
+            break;
         }
+    }
+    return true;
+}
 
-        case fnv1a("+CPSI"):
+bool SimComModem::OnReceive(FNV1a hash)
+{
+    int ch, len;
+    if (InputFieldNum(ch) && InputFieldNum(len), len)    // InputFieldNum(len) will return an error, since the length is followed by a colon
+    {
+        // data received for channel
+        Socket* s = FindSocket(ch, false);
+        if (!s)
         {
-            uint32_t tmp;
-            InputFieldFnv(tmp);    // network type
-            InputFieldFnv(tmp);
-            struct N { unsigned value = 0, digits = 0; } mcc, mnc;
-            N* n = &mcc;
-            for (auto ch: InputField())
-            {
-                if (ch >= '0' && ch <= '9')
-                {
-                    n->value = n->value * 10 + ch - '0';
-                    n->digits++;
-                }
-                else if (ch == '-' && n == &mcc)
-                {
-                    n = &mnc;
-                }
-                else
-                {
-                    break;
-                }
-            }
-            if (!mcc.digits || !(mnc.digits == 2 || mnc.digits == 3))
-            {
-                MYTRACE("Invalid MCC/MNC value");
-            }
-            NetworkInfo(gsm::NetworkInfo(mcc.value, mnc.value, mnc.digits));
-            async_return(true);
+            MYDBG("Incoming %d bytes of data for unallocated TCP socket %d", len, ch);
         }
-
-        case fnv1a("+CIEV"):
+        else
         {
-            // TODO: SIM800 network info
-            async_return(true);
+            MYTRACE("Incoming %d bytes of data for socket %p", len, s);
+            s->MaybeIncoming();
         }
+        RequestProcessing();
+        ReceiveForSocket(s, len);
+    }
+    return true;
+}
 
-        case fnv1a("+CFUN"):
+bool SimComModem::OnTlsEvent(FNV1a hash)
+{
+    int ch;
+    uint32_t type;
+    if (InputFieldNum(ch) && InputFieldFnv(type) && type == fnv1a("RECV EVENT"))
+    {
+        // buffered data received for channel
+        Socket* s = FindSocket(ch, true);
+        if (!s)
         {
-            int tmp;
-            if (InputFieldNum(tmp))
-            {
-                cfun = tmp;
-            }
-            async_return(true);
+            MYDBG("Indicated incoming data for unallocated TLS socket %d", ch);
         }
+        else
+        {
+            MYTRACE("Indicated data for socket %p", s);
+            s->Incoming();
+            RequestProcessing();
+        }
+    }
+    return true;
+}
 
-        case fnv1a("+CTZV"):
-        case fnv1a("+COPS"):
-        case fnv1a("+IPADDR"):
-        case fnv1a("+PDP"):
-        case fnv1a("RDY"):
-        case fnv1a("Call Ready"):
-        case fnv1a("SMS Ready"):
-        case fnv1a("*PSUTTZ"):
-        case fnv1a("DST"):
-            // events we don't want to handle
-            async_return(true);
+bool SimComModem::OnSystemInfo(FNV1a hash)
+{
+    uint32_t tmp;
+    InputFieldFnv(tmp);    // network type
+    InputFieldFnv(tmp);
+    struct N { unsigned value = 0, digits = 0; } mcc, mnc;
+    N* n = &mcc;
+    for (auto ch: InputField())
+    {
+        if (ch >= '0' && ch <= '9')
+        {
+            n->value = n->value * 10 + ch - '0';
+            n->digits++;
+        }
+        else if (ch == '-' && n == &mcc)
+        {
+            n = &mnc;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (!mcc.digits || !(mnc.digits == 2 || mnc.digits == 3))
+    {
+        MYTRACE("Invalid MCC/MNC value");
     }
+    NetworkInfo(gsm::NetworkInfo(mcc.value, mnc.value, mnc.digits));
+    return true;
+}
 
-    async_return(false);
+bool SimComModem::OnFunctionality(FNV1a hash)
+{
+    int tmp;
+    if (InputFieldNum(tmp))
+    {
+        cfun = tmp;
+    }
+    return true;
 }
-async_end
 
 async(SimComModem::SendMessageImpl, Message& msg)
 async_def(
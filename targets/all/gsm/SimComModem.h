@@ -22,6 +22,8 @@
 #include <nvram/nvram.h>
 
 #include <gsm/Modem.h>
+#include <gsm/Cmux.h>
+#include <gsm/URCTable.h>
 
 namespace gsm
 {
@@ -34,17 +36,43 @@ private:
         size_t incoming, outgoing, lastSent;
         bool error;
         uint8_t channel;
+        //! Row of the channel table the socket is registered in, the model may be reset by the time it is freed
+        uint8_t row;
+        uint8_t sendStreak;
+        //! Data accepted by the SIM800 but not acknowledged by the remote side, as reported by the last +CIPACK
+        //! and increased by the DATA ACCEPTs that followed
+        uint16_t unacked;
+        //! SIM800 send window has been full since stalledSince
+        bool stalled;
+        mono_t stalledSince;
+        //! Amount of data requested by the last SIM7600 +CCHRECV and the amount received so far
+        uint16_t pullRequested, pullReceived;
+        //! SIM7600 SSL context used by the connection plus one, zero if none
+        uint8_t tlsContext;
+        //! Address the SIM7600 UDP datagrams are sent to, resolved once when the socket is opened
+        char address[DnsCache::MaxAddress + 1];
     };
 
-    SimComSocket* FindSocket(uint8_t channel) { for (auto& s: Sockets()) { if (s.IsAllocated() && S(s).channel == channel) return S(&s); } return NULL; }
-    SimComSocket* FindSocket(uint8_t channel, bool secure) { for (auto& s: Sockets()) { if (s.IsAllocated() && s.IsSecure() == secure && S(s).channel == channel) return (SimComSocket*)&s; } return NULL; }
+    enum
+    {
+        //! Size of the channel table rows, the largest number of channels of the same kind
+        MaxChannels = 10,
+    };
+
+    //! Sockets with an allocated channel, indexed by the TLS flag and channel number,
+    //! SIM800 handles TLS per channel so it uses only the first row
+    SimComSocket* channels[2][MaxChannels] = {};
+
+    bool ChannelRow(bool secure) const { return secure && model == Model::SIM7600; }
+    SimComSocket*& ChannelSlot(Socket& sock) { return channels[S(sock).row][S(sock).channel]; }
+    SimComSocket* FindSocket(uint8_t channel, bool secure) { return channel < MaxChannels ? channels[ChannelRow(secure)][channel] : NULL; }
 
     SimComSocket& S(Socket& sock) { return (SimComSocket&)sock; }
     SimComSocket* S(Socket* sock) { return (SimComSocket*)sock; }
 
 public:
     SimComModem(ModemOptions& options, USART& usart, GPIOPin powerEnable, GPIOPin powerButton, GPIOPin status, GPIOPin dtr)
-        : Modem(io::DuplexPipe(gsmRx, gsmTx), options), usartRx(usart, gsmRx), usartTx(usart, gsmTx), powerEnable(powerEnable), powerButton(powerButton), status(status), dtr(dtr)
+        : Modem(io::DuplexPipe(gsmRx, gsmTx), options), usartRx(usart, gsmRx), usartTx(usart, gsmTx), mux(io::DuplexPipe(gsmRx, gsmTx)), linkRx(mux.Channel(DataLink)), linkTx(mux.Channel(DataLink)), powerEnable(powerEnable), powerButton(powerButton), status(status), dtr(dtr)
     {
     }
 
@@ -60,14 +88,24 @@ public:
 
     Model DetectedModel() const { return model; }
 
+    //! Checks if the link to the modem is multiplexed, see ModemOptions::UseMultiplexer
+    bool IsMultiplexed() const { return multiplexed && !mux.IsStopped(); }
+    //! Gets an additional serial link to the modem (1..Cmux::Channels - DataLink), usable while multiplexed,
+    //! the first multiplexer channel is used by the AT engine and the second one by the transparent connection;
+    //! the link is opened on the first request, its received data must be read from then on, otherwise it stalls the others
+    io::DuplexPipe AuxChannel(unsigned n) { ASSERT(n >= 1 && n <= Cmux::Channels - DataLink); mux.Open(n + DataLink); return mux.Channel(n + DataLink); }
+
 protected:
     virtual size_t SocketSizeImpl() const final override { return sizeof(SimComSocket); }
+    virtual size_t SocketCapacityImpl() const final override { return LOOKUP_TABLE(size_t, 0, 6, 2 + 10)[int(model)]; }
     virtual bool TryAllocateImpl(Socket& sock) final override;
+    virtual void FreeImpl(Socket& sock) final override;
     virtual async(ConnectImpl, Socket& sock) final override;
     virtual async(SendPacketImpl, Socket& sock) final override;
     virtual async(ReceivePacketImpl, Socket& sock) final override;
     virtual async(CheckIncomingImpl, Socket& sock) final override;
     virtual async(CloseImpl, Socket& sock) final override;
+    virtual async(ResolveImpl, Span host) final override;
 
     virtual async(SendMessageImpl, Message& msg) final override;
 
@@ -79,17 +117,95 @@ private:
 
     enum
     {
-        MaxPacket = 1024,
+        //! Maximum amount of data requested using a single +CCHRECV,
+        //! less is requested if the socket input limit does not allow more
+        MaxReceive = 1024,
+        //! Smallest packet size the send size adaptation shrinks to
+        MinPacket = 128,
+        //! Number of consecutive successful sends after which the packet size is doubled
+        PacketGrowStreak = 8,
+        //! Maximum amount of data kept in the SIM800 send buffer, both the data waiting for DATA ACCEPT
+        //! and the data not acknowledged by the remote side, two full packets so that one is being
+        //! transmitted while the previous one is being confirmed
+        SendWindow800 = 2 * 1460,
+        //! Interval of the +CIPACK queries while the SIM800 send window is full
+        StallCheckMs = 250,
+        //! Time after which the data waiting for DATA ACCEPT is considered lost if the window does not move
+        StallTimeoutMs = 10000,
+        //! Local port of the SIM7600 UDP socket on channel 0, other channels use the following ports
+        UdpLocalPort = 50000,
+        //! Number of SIM7600 SSL contexts assigned to TLS hosts
+        TlsContexts = 4,
+        //! Limit of the SIM7600 TLS handshake in seconds
+        TlsNegotiateSeconds = 60,
+        //! Multiplexer channel carrying the connection in transparent mode
+        DataLink = 2,
+        //! Time the carrier loss reported by the multiplexer may lag behind the notification of the lost connection
+        CarrierLossMs = 200,
+    };
+
+    //! States of the multiplexer channel carrying the connection in transparent mode
+    enum
+    {
+        LinkIdle,
+        LinkConnecting,
+        LinkData,
+        LinkFailed,
     };
 
+    //! SIM7600 SSL context dedicated to a single host, so that the configuration
+    //! and the session state kept by the modem are reused for further connections
+    struct TlsContext
+    {
+        uint32_t host;
+        bool configured;
+    };
+
+    TlsContext tlsContexts[TlsContexts] = {};
+    uint8_t tlsContextNext = 0;
+
+    //! Gets the index of the SSL context assigned to the host, reassigning the least recently assigned one
+    //! that is not used by any TLS connection if there is none
+    //! @returns -1 if all contexts are in use
+    int TlsContextFor(const char* host);
+    //! Stores the address of the socket host in the socket, resolving the name if needed
+    //! @returns false if the name cannot be resolved
+    async(ResolveDatagram, Socket& sock);
+    bool TlsContextInUse(unsigned ctx);
+
+    //! Largest packet the modem accepts in a single send command
+    size_t MaxPacket(bool secure) const
+    {
+        switch (model)
+        {
+            case Model::SIM800: return 1460;
+            case Model::SIM7600: return secure ? 2048 : 1500;
+            default: return MinPacket;
+        }
+    }
+
+    void PacketSent(SimComSocket& sock);
+    void PacketFailed(SimComSocket& sock);
+    //! Limits the length of the next SIM800 send to the free part of the send window
+    //! @returns zero if nothing can be sent until some of the data is confirmed
+    size_t SendLimit800(const SimComSocket& sock, size_t len) const;
+    //! Postpones the next send of a socket waiting for the SIM800 to confirm the data in flight,
+    //! the data is considered lost once the socket has been waiting for StallTimeoutMs
+    void SendStalled800(SimComSocket& sock);
+
     static const char* StatusName(Registration reg) { return STRINGS("NONE", "HOME", "SEARCHING", "DENIED", "UNKNOWN", "ROAMING")[int(reg)]; }
 
     const char* ModelName() const { return STRINGS(NULL, "SIM800", "SIM7600")[int(model)]; }
     unsigned ModelBaudRate() const { return LOOKUP_TABLE(unsigned, 115200, 460800, 3200000)[int(model)]; }
+    //! Multiplexer information field length (N1) requested from the model, the default one costs about a fifth of the link in framing
+    unsigned ModelMuxInfo() const { return LOOKUP_TABLE(unsigned, Cmux::DefaultInfo, 127, 512)[int(model)]; }
 
     io::Pipe gsmRx, gsmTx;
     io::USARTRxPipe usartRx;
     io::USARTTxPipe usartTx;
+    Cmux mux;
+    io::PipeReader linkRx;
+    io::PipeWriter linkTx;
     GPIOPin powerEnable, powerButton, status, dtr;
     bool removePin = false;
 
@@ -121,6 +237,24 @@ private:
 
     Timeout allocateTimeout = Timeout::Seconds(1);
     bool running = false;
+    //! The single socket connection is configured in transparent mode
+    bool transparent = false;
+    //! The SIM7600 keeps received TLS data until it is requested using +CCHRECV
+    bool tlsBuffered = false;
+    //! The AT engine is running over the first multiplexer channel
+    bool multiplexed = false;
+    //! Set by the +CDNSGIP response handler when the name has been resolved
+    bool resolved = false;
+    //! Host name being resolved by ResolveImpl
+    Span resolving;
+    //! Address reported by the last successful +CDNSGIP
+    char resolvedAddress[DnsCache::MaxAddress + 1];
+    //! State of the data link, see LinkIdle etc.
+    uint8_t linkState = LinkIdle;
+    //! Socket connected over the data link
+    Socket* linkSock = NULL;
+    //! Connection command sent over the data link
+    ATCommand linkCommand;
 
     async(PowerOnImpl) override;
     async(PowerOffImpl) override;
@@ -128,18 +262,46 @@ private:
     async(UnlockSimImpl) override;
     async(ConnectNetworkImpl) override;
     async(DisconnectNetworkImpl) override;
+    void OnTaskStopped() override;
 
     async(Initialize);
+    async(PrepareTls, Socket& sock);
     async(StartGprs);
+    //! Sends the connection command prepared in linkCommand over the data link
+    //! @returns true if the socket is connected over the data link
+    async(ConnectDataLink, Socket& sock);
+    //! Receives the responses and the data of the transparent connection from the data link
+    async(DataLinkTask);
+    //! Handles the return of the data link to command mode after the connection has been lost
+    void DataLinkLost();
 
     async(OnEvent, FNV1a id) override;
+    bool DispatchEvent(FNV1a hash);
+
+    bool OnIgnored(FNV1a hash);
+    bool OnSignalQuality(FNV1a hash);
+    bool OnRegistration(FNV1a hash);
+    bool OnPinStatus(FNV1a hash);
+    bool OnTlsOpen(FNV1a hash);
+    bool OnIpOpen(FNV1a hash);
+    bool OnConnectOK(FNV1a hash);
+    bool OnSendResult800(FNV1a hash);
+    bool OnConnectFail(FNV1a hash);
+    bool OnTlsClosed(FNV1a hash);
+    bool OnClosed(FNV1a hash);
+    bool OnIpClosed(FNV1a hash);
+    bool OnTlsReceive(FNV1a hash);
+    bool OnReceive(FNV1a hash);
+    bool OnTlsEvent(FNV1a hash);
+    bool OnSystemInfo(FNV1a hash);
+    bool OnFunctionality(FNV1a hash);
 
-    async(OnSendResponse800, FNV1a header);
     async(OnSendResponse7600, FNV1a header);
 
     async(OnReceiveId, FNV1a header);
     async(OnReceivePlainIP, FNV1a header);
     async(OnReceiveNetCch, FNV1a header);
+    async(OnReceiveDns, FNV1a header);
     async(OnReceiveShutOK, FNV1a header);
     async(OnReceivePowerDown, FNV1a header);
 };
@@ -25,14 +25,72 @@ async_def_once()
 {
     Output().Close();
     flags |= SocketFlags::AppClose;
-    owner->RequestProcessing();
+    Schedule();
     async_return(await_mask_not_timeout(flags, SocketFlags::ModemClosed, 0, timeout));
 }
 async_end
 
+async(Socket::SendDatagram, Span data)
+async_def(
+    uint8_t header[DatagramHeader];
+)
+{
+    ASSERT(IsDatagram());
+    ASSERT(data.Length() <= UINT16_MAX);
+    f.header[0] = data.Length();
+    f.header[1] = data.Length() >> 8;
+    async_return(await(tx.Write, Span(f.header, DatagramHeader)) == (int)DatagramHeader &&
+        await(tx.Write, data) == (int)data.Length());
+}
+async_end
+
+async(Socket::ReceiveDatagram, Buffer buffer)
+async_def(
+    size_t len;
+)
+{
+    ASSERT(IsDatagram());
+    if (!await(rx.Require, DatagramHeader))
+    {
+        async_return(0);
+    }
+
+    f.len = uint8_t(rx.Peek(0)) | uint8_t(rx.Peek(1)) << 8;
+    if (!await(rx.Require, DatagramHeader + f.len))
+    {
+        async_return(0);
+    }
+
+    rx.Advance(DatagramHeader);
+    size_t n = 0;
+    for (char c: rx.Enumerate(std::min(f.len, buffer.Length())))
+    {
+        buffer.Pointer()[n++] = c;
+    }
+    Consume(f.len);
+    async_return(n);
+}
+async_end
+
+void Socket::Consume(size_t len)
+{
+    Input().Advance(len);
+    if (IsReceiveParked() && InputSpace())
+    {
+        // do not depend on the pipe signal, it does not fire when the data
+        // drops below the input limit while the pipe itself still has room
+        Schedule();
+    }
+}
+
 void Socket::Release()
 {
     owner->ReleaseSocket(this);
 }
 
+void Socket::Schedule()
+{
+    owner->ScheduleSocket(this);
+}
+
 }
@@ -15,6 +15,8 @@
 #include <io/PipeReader.h>
 #include <io/PipeWriter.h>
 
+#include "SendPolicy.h"
+
 namespace gsm
 {
 
@@ -26,9 +28,17 @@ enum struct SocketFlags : uint16_t
     AppClose = 0x02,
     //! Socket has a reference from the application
     AppReference = 0x04,
+    //! UDP requested for socket
+    AppDatagram = 0x08,
 
     //! Check if data is incoming
     CheckIncoming = 0x10,
+    //! Receiving is postponed until the application frees space in the input pipe
+    ReceiveParked = 0x20,
+    //! The socket is connected in transparent mode, its data is transferred directly while the modem is in data mode
+    ModemDataMode = 0x40,
+    //! The socket has been released by the application but is kept connected for reuse by Modem::CreateSocket
+    AppParked = 0x80,
 
     //! The socket has a modem channel allocated
     ModemAllocated = 0x100,
@@ -50,11 +60,32 @@ enum struct SocketFlags : uint16_t
 
 DEFINE_FLAG_ENUM(SocketFlags);
 
+//! Optional socket settings passed to Modem::CreateSocket
+struct SocketOptions
+{
+    //! Output is held back until at least this many bytes are buffered,
+    //! so that small writes are merged into a single packet; zero disables coalescing.
+    //! Closing the socket sends the held output first, waiting at most Socket::CloseFlushMs
+    uint16_t coalesceBytes = 0;
+    //! Maximum time in milliseconds the output is held back waiting for more data
+    uint16_t coalesceMs = 0;
+    //! Scheduling of the output relative to other sockets and messages
+    SendPolicy policy;
+    //! Maximum number of unread bytes in the input pipe, further data is left buffered
+    //! in the modem where possible (SIM7600 TLS in buffered receive mode); zero for no limit.
+    //! The limit is required for the buffering to have any effect, the input pipe itself has no fixed size.
+    //! The input should be consumed using Socket::Consume, so that receiving resumes
+    //! as soon as the unread data drops below the limit
+    uint16_t inputLimit = 0;
+    //! Creates an UDP socket, see Socket::SendDatagram and Socket::ReceiveDatagram
+    bool datagram = false;
+};
+
 class Socket
 {
 public:
     Socket(class Modem* owner, bool* txSignal)
-        : owner(owner)
+        : owner(owner), scheduled(false), packetSize(0), inFlight(0), coalescing(false), flushing(false), backoffMs(0), connectMs(0)
     {
         tx.BindSignal(txSignal);
     }
@@ -65,27 +96,70 @@ public:
 
     bool IsConnected() const { return (flags & (SocketFlags::ModemConnected | SocketFlags::ModemClosed)) == SocketFlags::ModemConnected; }
     bool IsSecure() const { return !!(flags & SocketFlags::AppSecure); }
+    bool IsDatagram() const { return !!(flags & SocketFlags::AppDatagram); }
     bool IsClosed() const { return !!(flags & SocketFlags::ModemClosed); }
+    //! Maximum number of bytes currently sent to the modem in a single packet, zero if not yet determined
+    size_t PacketSize() const { return packetSize; }
+    //! Time in milliseconds from the connect request to the modem until the connection was established
+    //! (including the TLS handshake), zero if not connected yet
+    unsigned ConnectTime() const { return connectMs; }
 
     io::PipeReader Input() { return rx; }
     io::PipeWriter Output() { return tx; }
+    //! Removes the specified number of bytes read by the application from the input,
+    //! notifying the modem if it has been waiting for room in the input
+    void Consume(size_t len);
+
+    //! Length of the header preceding each datagram in the pipes of an UDP socket,
+    //! which contains the length of the datagram as a 16-bit little-endian number
+    static constexpr size_t DatagramHeader = 2;
+    //! Maximum time in milliseconds the close of a socket waits for the coalesced output to be sent
+    static constexpr unsigned CloseFlushMs = 5000;
+
+    //! Writes a single datagram to the output of an UDP socket
+    async(SendDatagram, Span data);
+    //! Reads a single datagram from the input of an UDP socket,
+    //! the part that does not fit in the buffer is discarded
+    //! @returns the number of bytes stored in the buffer
+    async(ReceiveDatagram, Buffer buffer);
 
 private:
     Socket(const Socket& other) = delete; // prevent accidental copying
 
     Socket* next;
     class Modem* owner;
+    Socket* scheduledNext;
+    bool scheduled;
     io::Pipe rx, tx;
     SocketFlags flags;
     uint16_t port;
+    uint16_t packetSize;
+    //! Output already passed to the modem, kept at the start of the pipe until the modem confirms it
+    uint16_t inFlight;
+    uint16_t coalesceBytes, coalesceMs;
+    uint16_t inputLimit;
+    bool coalescing;
+    mono_t coalesceStart;
+    //! The close is postponed until the coalesced output is sent, since flushStart
+    bool flushing;
+    mono_t flushStart;
+    uint16_t backoffMs;
+    mono_t backoffStart;
+    mono_t parkedSince;
+    mono_t connectStart;
+    uint32_t connectMs;
+    SendState send;
     const char* host;
 
+    //! Queues the socket for processing by the modem task after a state change
+    void Schedule();
+
     io::PipeReader OutputReader() { return tx; }
     io::PipeWriter InputWriter() { return rx; }
 
     bool IsNew() const
     {
-        return (flags & ~SocketFlags::AppSecure)
+        return (flags & ~(SocketFlags::AppSecure | SocketFlags::AppDatagram))
             == SocketFlags::AppReference;
     }
 
@@ -103,7 +177,106 @@ private:
 
     bool DataToSend()
     {
-        return IsConnected() && CanSend() && OutputReader().Available();
+        size_t len;
+        return IsConnected() && CanSend() && !(flags & SocketFlags::ModemDataMode) &&
+            (IsDatagram() ? NextDatagram(len) : OutputPending());
+    }
+
+    //! Gets the length of the first datagram in the output of an UDP socket that has not been passed to the modem yet
+    //! @returns false if the output does not contain a complete datagram
+    bool NextDatagram(size_t& len)
+    {
+        auto reader = OutputReader();
+        if (reader.Available() < inFlight + DatagramHeader)
+        {
+            return false;
+        }
+        len = uint8_t(reader.Peek(inFlight)) | uint8_t(reader.Peek(inFlight + 1)) << 8;
+        return reader.Available() >= inFlight + DatagramHeader + len;
+    }
+
+    //! Number of bytes in the output pipe that precede each packet sent to the modem
+    size_t OutputOverhead() const { return IsDatagram() ? DatagramHeader : 0; }
+    //! Gets the amount of output that has not been passed to the modem yet
+    size_t OutputPending() { return OutputReader().Available() - inFlight; }
+
+    //! Checks if the pending output should be held back to be merged with further writes
+    //! @returns zero if the data should be sent now, otherwise the remaining time to wait in clocks
+    mono_t CoalesceDelay(mono_t now)
+    {
+        size_t avail = OutputPending();
+        if (!coalesceBytes || avail >= coalesceBytes || (packetSize && avail >= packetSize) || (flags & SocketFlags::AppClose))
+        {
+            coalescing = false;
+            return 0;
+        }
+
+        if (!coalescing)
+        {
+            coalescing = true;
+            coalesceStart = now;
+        }
+
+        mono_t elapsed = now - coalesceStart;
+        mono_t limit = coalesceMs * (MONO_FREQUENCY / 1000);
+        if (elapsed >= limit)
+        {
+            coalescing = false;
+            return 0;
+        }
+        return limit - elapsed;
+    }
+
+    //! Checks if the close should wait for the output held back by coalescing to be sent first,
+    //! CoalesceDelay no longer holds the output back once the close is requested
+    //! @returns zero if the socket can be closed now, otherwise the remaining time to wait in clocks
+    mono_t CloseDelay(mono_t now)
+    {
+        if (!coalesceBytes || !IsConnected() || !OutputPending())
+        {
+            flushing = false;
+            return 0;
+        }
+
+        if (!flushing)
+        {
+            flushing = true;
+            flushStart = now;
+        }
+
+        mono_t elapsed = now - flushStart;
+        mono_t limit = CloseFlushMs * (MONO_FREQUENCY / 1000);
+        if (elapsed >= limit)
+        {
+            flushing = false;
+            return 0;
+        }
+        return limit - elapsed;
+    }
+
+    //! Postpones sending, used when the modem temporarily cannot accept more data
+    void Backoff(uint16_t ms)
+    {
+        backoffMs = ms;
+        backoffStart = MONO_CLOCKS;
+    }
+
+    //! Gets the remaining time of the send backoff in clocks
+    mono_t BackoffDelay(mono_t now)
+    {
+        if (!backoffMs)
+        {
+            return 0;
+        }
+
+        mono_t elapsed = now - backoffStart;
+        mono_t limit = backoffMs * (MONO_FREQUENCY / 1000);
+        if (elapsed >= limit)
+        {
+            backoffMs = 0;
+            return 0;
+        }
+        return limit - elapsed;
     }
 
     bool DataToReceive()
@@ -135,7 +308,68 @@ private:
     bool CanReceive()
     {
         return (flags & (SocketFlags::ModemConnected | SocketFlags::ModemIncoming | SocketFlags::ModemClosing | SocketFlags::ModemClosed)) == (SocketFlags::ModemConnected | SocketFlags::ModemIncoming)
-            && InputWriter().CanAllocate();
+            && InputSpace();
+    }
+
+    //! Gets the number of bytes that can be received without exceeding the input limit,
+    //! SIZE_MAX without a limit unless the input pipe cannot allocate more memory
+    size_t InputSpace()
+    {
+        if (!InputWriter().CanAllocate())
+        {
+            return 0;
+        }
+        if (!inputLimit)
+        {
+            return SIZE_MAX;
+        }
+        size_t avail = Input().Available();
+        return avail < inputLimit ? inputLimit - avail : 0;
+    }
+
+    bool IsReceiveParked() const
+    {
+        return !!(flags & SocketFlags::ReceiveParked);
+    }
+
+    //! Postpones receiving until the application reads from the input pipe;
+    //! Consume wakes the modem explicitly, for direct reads from the pipe this relies on io::Pipe
+    //! setting the bound signal when the reader releases its buffer space, which only happens
+    //! once the pipe has been full (i.e. not for the input limit)
+    void ParkReceive(bool* signal)
+    {
+        flags |= SocketFlags::ReceiveParked;
+        rx.BindSignal(signal);
+    }
+
+    void ResumeReceive()
+    {
+        if (IsReceiveParked())
+        {
+            flags &= ~SocketFlags::ReceiveParked;
+            rx.BindSignal(NULL);
+        }
+    }
+
+    bool IsParked() const
+    {
+        return !!(flags & SocketFlags::AppParked);
+    }
+
+    //! Checks if the connection can be kept for reuse after the application releases the socket,
+    //! only an idle stream connection with nothing left in either direction can be handed over
+    bool CanPark()
+    {
+        return !IsDatagram() && IsConnected() && CanSend() &&
+            !(flags & (SocketFlags::AppClose | SocketFlags::ModemIncoming | SocketFlags::CheckIncoming)) &&
+            !OutputReader().Available() && !Input().Available();
+    }
+
+    //! Checks if the socket is a parked connection to the specified endpoint
+    bool Matches(Span host, uint16_t port, bool tls) const
+    {
+        return IsParked() && this->port == port && IsSecure() == tls &&
+            strlen(this->host) == host.Length() && !memcmp(this->host, host.Pointer(), host.Length());
     }
 
     bool IsAllocated() const
@@ -155,9 +389,20 @@ private:
         flags |= SocketFlags::ModemReference;
     }
 
+    void Connecting()
+    {
+        ASSERT(NeedsConnect());
+        flags |= SocketFlags::ModemConnecting;
+        connectStart = MONO_CLOCKS;
+    }
+
     void Connected()
     {
         ASSERT(IsAllocated());
+        if (!!(flags & SocketFlags::ModemConnecting))
+        {
+            connectMs = (MONO_CLOCKS - connectStart) / (MONO_FREQUENCY / 1000);
+        }
         flags = (flags & ~SocketFlags::ModemConnecting) | SocketFlags::ModemConnected;
     }
 
@@ -165,12 +410,14 @@ private:
     {
         ASSERT(IsConnected());
         flags |= SocketFlags::ModemIncoming;
+        Schedule();
     }
 
     void MaybeIncoming()
     {
         ASSERT(IsConnected());
         flags |= SocketFlags::CheckIncoming;
+        Schedule();
     }
 
     void IncomingRequested()
@@ -199,9 +446,11 @@ private:
 
     void Finished()
     {
+        ResumeReceive();
         Output().Close();
         InputWriter().Close();
         flags = (flags & ~(SocketFlags::ModemConnecting | SocketFlags::ModemReference)) | SocketFlags::ModemConnected | SocketFlags::ModemClosed;
+        Schedule();
     }
 
     friend class Modem;
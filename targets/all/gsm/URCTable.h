@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2021 triaxis s.r.o.
+ * Licensed under the MIT license. See LICENSE.txt file in the repository root
+ * for full license information.
+ *
+ * gsm/URCTable.h
+ *
+ * Compile-time dispatch table for unsolicited result codes
+ */
+
+#pragma once
+
+#include <base/base.h>
+#include <base/fnv1.h>
+
+namespace gsm
+{
+
+//! Entry of an URC dispatch table, maps the FNV1a hash of the event header to a handler
+template<typename T> struct URCEntry
+{
+    uint32_t hash;
+    bool (T::*handler)(FNV1a hash);
+};
+
+//! Table of URC handlers sorted by hash at compile time
+//!
+//! Lookups use a 64-bit filter indexed by the low bits of the hash, which
+//! rejects most unknown events in constant time, followed by a binary search.
+//! Tables should be declared constexpr and checked using
+//! static_assert(table.Valid()) to catch hash collisions at compile time.
+template<typename T, size_t N> class URCTable
+{
+public:
+    constexpr URCTable(const URCEntry<T> (&source)[N])
+        : entries{}, filter(0)
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            // insertion sort, the tables are small and this runs at compile time
+            size_t j = i;
+            while (j > 0 && entries[j - 1].hash > source[i].hash)
+            {
+                entries[j] = entries[j - 1];
+                j--;
+            }
+            entries[j] = source[i];
+            filter |= uint64_t(1) << (source[i].hash & 63);
+        }
+    }
+
+    //! Checks that there are no duplicate hashes in the table
+    constexpr bool Valid() const
+    {
+        for (size_t i = 1; i < N; i++)
+        {
+            if (entries[i - 1].hash == entries[i].hash)
+                return false;
+        }
+        return true;
+    }
+
+    //! Checks if the hash may be present in the table
+    constexpr bool MayContain(uint32_t hash) const { return (filter >> (hash & 63)) & 1; }
+
+    //! Finds the handler for the specified hash
+    //! @returns NULL if there is no handler
+    const URCEntry<T>* Find(uint32_t hash) const
+    {
+        if (!MayContain(hash))
+            return NULL;
+
+        size_t lo = 0, hi = N;
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (entries[mid].hash < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo < N && entries[lo].hash == hash ? &entries[lo] : NULL;
+    }
+
+    //! Invokes the handler for the specified hash
+    //! @returns false if there is no handler or the handler did not accept the event
+    bool Dispatch(T& target, FNV1a hash) const
+    {
+        auto e = Find(hash);
+        return e && (target.*e->handler)(hash);
+    }
+
+private:
+    URCEntry<T> entries[N];
+    uint64_t filter;
+};
+
+template<typename T, size_t N> constexpr URCTable<T, N> MakeURCTable(const URCEntry<T> (&entries)[N])
+{
+    return URCTable<T, N>(entries);
+}
+
+}